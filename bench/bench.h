@@ -0,0 +1,140 @@
+// Shared by the benchmarks in this directory (see `make bench`). Each result
+// is printed as one line of space-separated `key=value` pairs: the benchmark,
+// the configuration it was built with and then its measurements.
+#ifndef BENCH_H
+#define BENCH_H
+
+#if !defined(COROUTINE_STACK_MALLOC)
+#define COROUTINE_STACK_MMAP
+#endif
+#define COROUTINE_IMPLEMENTATION
+#include "../coroutine.h"
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+
+#if defined(__x86_64__)
+#define BENCH_ARCH "x86_64"
+#elif defined(__aarch64__)
+#define BENCH_ARCH "aarch64"
+#endif
+
+#if defined(COROUTINE_SHARED_STACK)
+#define BENCH_STACK "shared"
+#elif defined(COROUTINE_STACK_MALLOC)
+#define BENCH_STACK "malloc"
+#else
+#define BENCH_STACK "mmap"
+#endif
+
+#if defined(COROUTINE_IO_URING)
+#define BENCH_BACKEND "io_uring"
+#elif defined(COROUTINE_POLL_EPOLL)
+#define BENCH_BACKEND "epoll"
+#else
+#define BENCH_BACKEND "poll"
+#endif
+
+#if defined(COROUTINE_SWITCH_INTEGER_ONLY)
+#define BENCH_SWITCH "integer_only"
+#elif defined(COROUTINE_SWITCH_FP_STATE)
+#define BENCH_SWITCH "fp_state"
+#else
+#define BENCH_SWITCH "default"
+#endif
+
+
+static inline double bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+static inline void bench_report(const char* name, const char* format, ...) __attribute__((format(printf, 2, 3)));
+static inline void bench_report(const char* name, const char* format, ...) {
+    printf("bench=%s arch=%s stack=%s backend=%s switch=%s ", name, BENCH_ARCH, BENCH_STACK, BENCH_BACKEND, BENCH_SWITCH);
+
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+
+    printf("\n");
+    fflush(stdout);
+}
+
+
+// NOTE: The peak resident set size, which only grows, so the difference
+//       between two calls is what was committed in between.
+static inline long bench_peak_rss_bytes(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return usage.ru_maxrss;
+#else
+    return usage.ru_maxrss * 1024;
+#endif
+}
+
+
+static inline int bench_compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+
+// NOTE: Sorts `samples` in place.
+static inline double bench_percentile(double* samples, int count, double percentile) {
+    qsort(samples, count, sizeof(*samples), bench_compare_doubles);
+    int index = (int)(percentile / 100.0 * (count - 1) + 0.5);
+    return samples[index];
+}
+
+// NOTE: An fd that turns readable when signalled, with the read and write end
+//       in `fd[0]` and `fd[1]`. On Linux it's the same eventfd, so each one
+//       only costs a single descriptor.
+typedef struct BenchSignal {
+    int fd[2];
+} BenchSignal;
+
+static inline int bench_signal_open(BenchSignal* signal) {
+#if defined(__linux__)
+    signal->fd[0] = signal->fd[1] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    return signal->fd[0] < 0 ? -1 : 0;
+#else
+    if (pipe(signal->fd) < 0)
+        return -1;
+    fcntl(signal->fd[0], F_SETFL, O_NONBLOCK);
+    fcntl(signal->fd[1], F_SETFL, O_NONBLOCK);
+    return 0;
+#endif
+}
+
+static inline void bench_signal_raise(BenchSignal* signal) {
+    uint64_t one = 1;
+    (void) !write(signal->fd[1], &one, sizeof(one));
+}
+
+static inline void bench_signal_clear(BenchSignal* signal) {
+    uint64_t value;
+    (void) !read(signal->fd[0], &value, sizeof(value));
+}
+
+static inline void bench_signal_close(BenchSignal* signal) {
+    close(signal->fd[0]);
+    if (signal->fd[1] != signal->fd[0])
+        close(signal->fd[1]);
+}
+
+#endif
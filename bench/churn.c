@@ -0,0 +1,44 @@
+// Create/exit churn: how much a short-lived coroutine costs from
+// `coroutine_create` until its slot is back on the free list, one at a time
+// and in batches that all exist at once.
+//
+//     cc bench/churn.c -O2 -DNDEBUG [-DCOROUTINE_STACK_MALLOC | -DCOROUTINE_SHARED_STACK]
+#include "bench.h"
+
+#define COROUTINES 1000000
+#define ROUNDS     5
+
+
+static void noop(void* arg) {
+    (void) arg;
+}
+
+
+static double bench_churn(int batch) {
+    double start = bench_now_ns();
+    for (int i = 0; i < COROUTINES; i += batch) {
+        for (int j = 0; j < batch; ++j)
+            coroutine_create(noop, NULL, 0, NULL);
+        while (coroutine_active() > 1)
+            coroutine_yield();
+    }
+    return (bench_now_ns() - start) / COROUTINES;
+}
+
+
+static void report(int batch) {
+    double best = bench_churn(batch);
+    for (int i = 1; i < ROUNDS; ++i) {
+        double ns = bench_churn(batch);
+        if (ns < best) best = ns;
+    }
+    bench_report("churn", "batch=%d ns_per_coroutine=%.2f", batch, best);
+}
+
+
+int main(void) {
+    report(1);
+    report(1000);
+    coroutine_destroy_all();
+    return 0;
+}
@@ -0,0 +1,52 @@
+// Memory per idle coroutine: the growth of the resident set when 10k
+// coroutines that used 1 KiB of stack are parked. Build it once per stack
+// allocator:
+//
+//     cc bench/memory.c -O2 -DNDEBUG [-DCOROUTINE_STACK_MALLOC | -DCOROUTINE_SHARED_STACK]
+#include "bench.h"
+
+#define COROUTINES 10000
+#define STACK_USED 1024
+
+static int g_ids[COROUTINES];
+static int g_sum;
+
+
+static void idle(void* arg) {
+    (void) arg;
+    volatile char used[STACK_USED];
+    for (int i = 0; i < STACK_USED; ++i)
+        used[i] = 1;
+    coroutine_switch(0, CM_PARK);
+
+    // NOTE: Read after the switch, so the buffer is still on the stack while
+    //       it's parked rather than dropped before a tail call.
+    g_sum += used[0] + used[STACK_USED - 1];
+}
+
+
+int main(void) {
+    // NOTE: Warm up the tables and the allocator, so the first coroutine
+    //       doesn't pay for what every later one shares.
+    int warm_up = coroutine_create(idle, NULL, 0, NULL);
+    coroutine_yield();
+    coroutine_wake_up(warm_up);
+    coroutine_yield();
+
+    long before = bench_peak_rss_bytes();
+    for (int i = 0; i < COROUTINES; ++i)
+        g_ids[i] = coroutine_create(idle, NULL, 0, NULL);
+    while (coroutine_active() > 1)
+        coroutine_yield();
+    long after = bench_peak_rss_bytes();
+
+    bench_report("memory", "coroutines=%d stack_used=%d stack_size=%d bytes_per_coroutine=%ld",
+                 COROUTINES, STACK_USED, COROUTINE_STACK_SIZE, (after - before) / COROUTINES);
+
+    for (int i = 0; i < COROUTINES; ++i)
+        coroutine_wake_up(g_ids[i]);
+    while (coroutine_active() > 1)
+        coroutine_yield();
+    coroutine_destroy_all();
+    return 0;
+}
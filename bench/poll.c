@@ -0,0 +1,99 @@
+// Poll scaling: what idle coroutines waiting for fds cost everyone else. With
+// 10, 1k and 10k of them, it measures a yield between two busy coroutines and
+// the latency of waking up one of the idle ones. Build it once per backend:
+//
+//     cc bench/poll.c -O2 -DNDEBUG [-DCOROUTINE_POLL_EPOLL | -DCOROUTINE_IO_URING]
+#include "bench.h"
+
+#define SWITCHES 200000
+#define WAKEUPS  2000
+
+static BenchSignal g_signals[10000];
+static int         g_seen;
+static int         g_stop;
+static int         g_alive;
+
+
+static void idle(void* arg) {
+    BenchSignal* signal = *(BenchSignal**) arg;
+    g_alive += 1;
+    for (;;) {
+        coroutine_wait_read(signal->fd[0]);
+        bench_signal_clear(signal);
+        if (g_stop)
+            break;
+        g_seen += 1;
+    }
+    g_alive -= 1;
+}
+
+
+static void yielder(void* arg) {
+    (void) arg;
+    for (int i = 0; i < SWITCHES / 2; ++i)
+        coroutine_yield();
+}
+
+
+static void bench_poll(int count) {
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    if (limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    int opened = 0;
+    while (opened < count && bench_signal_open(&g_signals[opened]) == 0)
+        opened += 1;
+    if (opened < count) {
+        bench_report("poll", "waiters=%d skipped=1", count);
+        for (int i = 0; i < opened; ++i)
+            bench_signal_close(&g_signals[i]);
+        return;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        BenchSignal* signal = &g_signals[i];
+        coroutine_create(idle, &signal, sizeof(signal), NULL);
+    }
+    while (coroutine_active() > 1)
+        coroutine_yield();
+
+    coroutine_create(yielder, NULL, 0, NULL);
+    double start = bench_now_ns();
+    for (int i = 0; i < SWITCHES / 2; ++i)
+        coroutine_yield();
+    double ns_per_switch = (bench_now_ns() - start) / SWITCHES;
+    while (coroutine_active() > 1)
+        coroutine_yield();
+
+    g_seen = 0;
+    start = bench_now_ns();
+    for (int i = 0; i < WAKEUPS; ++i) {
+        bench_signal_raise(&g_signals[(i * 7919) % count]);
+        while (g_seen == i)
+            coroutine_yield();
+    }
+    double ns_per_wakeup = (bench_now_ns() - start) / WAKEUPS;
+
+    bench_report("poll", "waiters=%d ns_per_switch=%.2f ns_per_wakeup=%.0f", count, ns_per_switch, ns_per_wakeup);
+
+    g_stop = 1;
+    for (int i = 0; i < count; ++i)
+        bench_signal_raise(&g_signals[i]);
+    while (g_alive > 0)
+        coroutine_yield();
+    for (int i = 0; i < count; ++i)
+        bench_signal_close(&g_signals[i]);
+    g_stop = 0;
+}
+
+
+int main(void) {
+    bench_poll(10);
+    bench_poll(1000);
+    bench_poll(10000);
+    coroutine_destroy_all();
+    return 0;
+}
@@ -0,0 +1,68 @@
+// Context switch microbenchmark. Build it once per switch variant (see
+// `make bench-switch`) and compare the numbers:
+//
+//     cc bench/switch.c -O2 -DNDEBUG [-DCOROUTINE_SWITCH_INTEGER_ONLY | -DCOROUTINE_SWITCH_FP_STATE]
+//
+#include "bench.h"
+
+#define SWITCHES 2000000
+#define ROUNDS   5
+
+
+// NOTE: Two coroutines yielding to each other, so every switch goes through
+//       the scheduler's run queue.
+static void yielder(void* arg) {
+    (void) arg;
+    for (int i = 0; i < SWITCHES / 2; ++i)
+        coroutine_yield();
+}
+
+static double bench_yield(void) {
+    coroutine_create(yielder, NULL, 0, NULL);
+    coroutine_create(yielder, NULL, 0, NULL);
+
+    double start = bench_now_ns();
+    while (coroutine_active() > 1)
+        coroutine_yield();
+    return (bench_now_ns() - start) / SWITCHES;
+}
+
+
+// NOTE: Two coroutines handing off to each other with `coroutine_switch_to`,
+//       which skips the run queue and is the closest to a bare switch.
+static int partner[2];
+
+static void handoff(void* arg) {
+    int self = *(int*) arg;
+    for (int i = 0; i < SWITCHES / 2; ++i)
+        coroutine_switch_to(partner[!self]);
+}
+
+static double bench_switch_to(void) {
+    int first = 0, second = 1;
+    partner[0] = coroutine_create(handoff, &first,  sizeof(first),  NULL);
+    partner[1] = coroutine_create(handoff, &second, sizeof(second), NULL);
+
+    double start = bench_now_ns();
+    while (coroutine_active() > 1)
+        coroutine_yield();
+    return (bench_now_ns() - start) / SWITCHES;
+}
+
+
+static void report(const char* name, double (*bench)(void)) {
+    double best = bench();
+    for (int i = 1; i < ROUNDS; ++i) {
+        double ns = bench();
+        if (ns < best) best = ns;
+    }
+    bench_report(name, "frame_bytes=%zu ns_per_switch=%.2f", (size_t) COROUTINE__FRAME_SIZE, best);
+}
+
+
+int main(void) {
+    report("switch_yield",     bench_yield);
+    report("switch_handoff",   bench_switch_to);
+    coroutine_destroy_all();
+    return 0;
+}
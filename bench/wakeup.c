@@ -0,0 +1,103 @@
+// Wake-up latency: the time from making a suspended coroutine runnable until
+// it's running again, for each way it can be suspended.
+//
+//     cc bench/wakeup.c -O2 -DNDEBUG [-DCOROUTINE_POLL_EPOLL | -DCOROUTINE_IO_URING]
+#include "bench.h"
+
+#define SAMPLES       100000
+#define TIMER_SAMPLES 200
+
+static double g_samples[SAMPLES];
+static double g_woken_at;
+static int    g_seen;
+
+
+static void report(const char* name, int count) {
+    double total = 0;
+    for (int i = 0; i < count; ++i)
+        total += g_samples[i];
+    double p50 = bench_percentile(g_samples, count, 50);
+    double p99 = bench_percentile(g_samples, count, 99);
+    bench_report(name, "samples=%d ns_mean=%.0f ns_p50=%.0f ns_p99=%.0f", count, total / count, p50, p99);
+}
+
+
+// NOTE: From `coroutine_wake_up` on a parked coroutine until it runs.
+static void parker(void* arg) {
+    (void) arg;
+    for (int i = 0; i < SAMPLES; ++i) {
+        coroutine_switch(0, CM_PARK);
+        g_samples[i] = bench_now_ns() - g_woken_at;
+    }
+}
+
+static void bench_park(void) {
+    int id = coroutine_create(parker, NULL, 0, NULL);
+    coroutine_yield();
+    for (int i = 0; i < SAMPLES; ++i) {
+        g_woken_at = bench_now_ns();
+        coroutine_wake_up(id);
+        coroutine_yield();
+    }
+    report("wakeup_park", SAMPLES);
+}
+
+
+// NOTE: From an fd turning readable until the coroutine waiting for it runs,
+//       while the waker keeps yielding. It includes however many switches
+//       pass before the scheduler polls (see COROUTINE_POLL_INTERVAL).
+static void reader(void* arg) {
+    BenchSignal* signal = arg;
+    for (int i = 0; i < SAMPLES; ++i) {
+        coroutine_wait_read(signal->fd[0]);
+        g_samples[i] = bench_now_ns() - g_woken_at;
+        bench_signal_clear(signal);
+        g_seen += 1;
+    }
+}
+
+static void bench_fd(void) {
+    BenchSignal signal;
+    if (bench_signal_open(&signal) < 0) {
+        perror("bench_signal_open");
+        exit(EXIT_FAILURE);
+    }
+
+    g_seen = 0;
+    coroutine_create(reader, &signal, sizeof(signal), NULL);
+    coroutine_yield();
+    for (int i = 0; i < SAMPLES; ++i) {
+        g_woken_at = bench_now_ns();
+        bench_signal_raise(&signal);
+        while (g_seen == i)
+            coroutine_yield();
+    }
+    bench_signal_close(&signal);
+    report("wakeup_fd", SAMPLES);
+}
+
+
+// NOTE: How late `coroutine_sleep_ms(1)` returns while nothing else is
+//       runnable, so the scheduler blocks until the timer is due.
+static void sleeper(void* arg) {
+    (void) arg;
+    for (int i = 0; i < TIMER_SAMPLES; ++i) {
+        double start = bench_now_ns();
+        coroutine_sleep_ms(1);
+        g_samples[i] = bench_now_ns() - start - 1e6;
+    }
+}
+
+static void bench_timer(void) {
+    coroutine_join(coroutine_create(sleeper, NULL, 0, NULL));
+    report("wakeup_timer", TIMER_SAMPLES);
+}
+
+
+int main(void) {
+    bench_park();
+    bench_fd();
+    bench_timer();
+    coroutine_destroy_all();
+    return 0;
+}
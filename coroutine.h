@@ -2,25 +2,205 @@
 #define COROUTINE_H_
 
 #include <stddef.h>
+#include <sys/types.h>
 
 typedef enum CoroutineMode {
     CM_YIELD,
     CM_WAIT_READ,
     CM_WAIT_WRITE,
+    CM_WAIT_COMPLETION,
+    CM_SLEEP,
+    CM_PARK,        // Suspended until coroutine_wake_up.
 } CoroutineMode;
 
+typedef enum CoroutineFlags {
+    CF_NONE      = 0,
+    CF_STEALABLE = 1 << 0,  // May be resumed by another scheduler (see COROUTINE_WORK_STEALING).
+    CF_PRIORITY_HIGH = 1 << 1,  // Runs ahead of the others, e.g. for latency-sensitive I/O.
+    CF_PRIORITY_LOW  = 1 << 2,  // Runs after the others, e.g. for background work.
+} CoroutineFlags;
+
+// NOTE: Ids carry a generation, so the id of a coroutine that has finished
+//       never refers to a later coroutine that reuses its slot. They're only
+//       meaningful on the scheduler that created the coroutine.
 int  coroutine_create(void (*f)(void*), const void* data, size_t size, void (*on_destroy)(void*, size_t));
+int  coroutine_create_ex(void (*f)(void*), const void* data, size_t size, void (*on_destroy)(void*, size_t), int flags);
 void coroutine_switch(int fd, CoroutineMode mode);
+int  coroutine_switch_to(int id);
 int  coroutine_id(void);
 int  coroutine_active(void);
 void coroutine_wake_up(int id);
+// Like coroutine_wake_up, but safe in a signal handler on the scheduler's
+// thread. It only records the id, and the coroutine is woken up the next
+// time the scheduler looks for ready fds, which the signal interrupts. If
+// more than COROUTINE_SIGNAL_WAKES are pending by then, every coroutine
+// that's blocked is woken up instead.
+void coroutine_wake_up_from_signal(int id);
+int  coroutine_join(int id);
 void coroutine_destroy_all(void);
 
+// Every thread starts out on a default scheduler, which is what the other
+// functions act on until the thread enters another one. Only the entered
+// scheduler runs: the others keep their coroutines as they were until
+// they're entered again. A scheduler must only be entered by one thread at a
+// time, and only from the thread itself (coroutine 0) of the current one.
+typedef struct CoroutineScheduler CoroutineScheduler;
+
+CoroutineScheduler* coroutine_scheduler_create(void);
+// Destroys its coroutines like coroutine_destroy_all. It can't be current.
+void coroutine_scheduler_destroy(CoroutineScheduler* scheduler);
+CoroutineScheduler* coroutine_scheduler_current(void);
+// Makes `scheduler` (NULL for the thread's default) current and returns the
+// one that was.
+CoroutineScheduler* coroutine_scheduler_enter(CoroutineScheduler* scheduler);
+
+void coroutine_sleep_ms(int ms);
+int  coroutine_wait_timeout(int fd, CoroutineMode mode, int timeout_ms);
+
+ssize_t coroutine_read(int fd, void* buffer, size_t bytes);
+ssize_t coroutine_write(int fd, const void* buffer, size_t bytes);
+
+// A bounded queue of `value_size`-byte values. Send and receive return 1 on
+// success and -1 once the channel is closed (a receive first drains what's
+// left). When the channel is full or empty they suspend the coroutine, and
+// the try variants return 0 instead. Any thread may use a channel.
+typedef struct CoroutineChannel CoroutineChannel;
+
+CoroutineChannel* coroutine_channel_create(size_t value_size, int capacity);
+void coroutine_channel_destroy(CoroutineChannel* channel);
+void coroutine_channel_close(CoroutineChannel* channel);
+int  coroutine_channel_send(CoroutineChannel* channel, const void* value);
+int  coroutine_channel_recv(CoroutineChannel* channel, void* value);
+int  coroutine_channel_try_send(CoroutineChannel* channel, const void* value);
+int  coroutine_channel_try_recv(CoroutineChannel* channel, void* value);
+
+// Synchronization between coroutines that parks the waiters instead of
+// polling, and wakes them up in FIFO order. They're ready to use when zeroed
+// (a semaphore then has no permits), and any thread may use them.
+typedef struct CoroutineWaitQueue {
+    union Coroutine* head;
+    union Coroutine* tail;
+    int              count;
+} CoroutineWaitQueue;
+
+typedef struct CoroutineMutex     { int lock; int locked; CoroutineWaitQueue waiters; } CoroutineMutex;
+typedef struct CoroutineCond      { int lock;             CoroutineWaitQueue waiters; } CoroutineCond;
+typedef struct CoroutineSemaphore { int lock; int count;  CoroutineWaitQueue waiters; } CoroutineSemaphore;
+typedef struct CoroutineWaitGroup { int lock; int count;  CoroutineWaitQueue waiters; } CoroutineWaitGroup;
+
+void coroutine_mutex_lock(CoroutineMutex* mutex);
+int  coroutine_mutex_try_lock(CoroutineMutex* mutex);
+void coroutine_mutex_unlock(CoroutineMutex* mutex);
+
+void coroutine_cond_wait(CoroutineCond* cond, CoroutineMutex* mutex);
+void coroutine_cond_signal(CoroutineCond* cond);
+void coroutine_cond_broadcast(CoroutineCond* cond);
+
+void coroutine_semaphore_init(CoroutineSemaphore* semaphore, int count);
+void coroutine_semaphore_acquire(CoroutineSemaphore* semaphore);
+int  coroutine_semaphore_try_acquire(CoroutineSemaphore* semaphore);
+void coroutine_semaphore_release(CoroutineSemaphore* semaphore);
+
+void coroutine_wait_group_add(CoroutineWaitGroup* group, int count);
+void coroutine_wait_group_done(CoroutineWaitGroup* group);
+void coroutine_wait_group_wait(CoroutineWaitGroup* group);
+
+// A value that's set once and that any number of coroutines can wait for,
+// e.g. the result of a coroutine. It's ready to use when zeroed.
+typedef struct CoroutineFuture { int lock; int ready; void* value; CoroutineWaitQueue waiters; } CoroutineFuture;
+
+void  coroutine_future_set(CoroutineFuture* future, void* value);
+void* coroutine_future_get(CoroutineFuture* future);
+int   coroutine_future_ready(CoroutineFuture* future);
+
+// Counters kept by the scheduler (see COROUTINE_STATS). Times are in
+// nanoseconds. A coroutine's cover its life so far, and a scheduler's the
+// time since its thread first used it.
+typedef struct CoroutineStats {
+    unsigned long long switches;    // Times it switched out.
+    unsigned long long run_ns;      // Time it was running.
+    unsigned long long wait_ns;     // Time from waiting on an fd, a completion or a timer until it ran again.
+} CoroutineStats;
+
+typedef struct CoroutineSchedulerStats {
+    unsigned long long switches;
+    unsigned long long run_ns;      // Time its coroutines, including the thread's own, were running.
+    unsigned long long idle_ns;     // Time blocked on fds and timers with nothing to run.
+    unsigned long long polls;       // Checks for ready fds, completions and timers.
+    unsigned long long ready;       // fds and completions that those checks found ready.
+    unsigned long long creates;
+    unsigned long long exits;
+    int active;                     // Coroutines that can run (see coroutine_active).
+    int peak_active;
+    int sleeping;                   // Coroutines waiting on an fd or a completion.
+    int peak_sleeping;
+} CoroutineSchedulerStats;
+
+// Returns 0 if `id` isn't a coroutine of this scheduler (0 is the thread).
+int coroutine_stats(int id, CoroutineStats* stats);
+void coroutine_scheduler_stats(CoroutineSchedulerStats* stats);
+// Fills in at most `count` entries, one per scheduler in use by any thread,
+// and returns how many. Another scheduler's `active` and `sleeping` are as
+// of its last poll.
+int coroutine_scheduler_stats_all(CoroutineSchedulerStats* stats, int count);
+
+// Stack use per entry function, measured with COROUTINE_STACK_PROFILE as
+// coroutines exit. Bucket `i` counts the coroutines that used at most
+// 256 << i bytes, and more than half of that.
+#define COROUTINE_STACK_PROFILE_BUCKETS 24
+
+typedef struct CoroutineStackProfile {
+    void (*entry)(void*);
+    unsigned long long count;       // Coroutines that exited.
+    unsigned long long max;         // Most bytes any of them used.
+    unsigned long long buckets[COROUTINE_STACK_PROFILE_BUCKETS];
+} CoroutineStackProfile;
+
+// Bytes of its stack `id` has touched so far, or 0 if it isn't a coroutine of
+// this scheduler or stacks aren't profiled.
+size_t coroutine_stack_used(int id);
+// Fills in at most `count` entries, one per entry function of any thread, and
+// returns how many there are.
+int coroutine_stack_profile(CoroutineStackProfile* profiles, int count);
+
+// Scheduler events recorded with COROUTINE_TRACE. Each thread records into a
+// ring that keeps its latest COROUTINE_TRACE_SIZE events.
+typedef enum CoroutineTraceType {
+    CT_SWITCH_IN,   // `id` starts running.
+    CT_SWITCH_OUT,  // `id` yields.
+    CT_WAIT,        // `id` switches out to wait on `fd`, or on a timer or wake-up if it's -1.
+    CT_READY,       // `id` can run again.
+    CT_CREATE,      // `id` was created.
+    CT_EXIT,        // `id` returned.
+    CT_ACCEPT,      // `fd` was accepted by `id` (tcp.h).
+    CT_DISPATCH,    // `fd` was handed to worker thread `id` (tcp.h).
+    CT_USER,        // The first type free for applications.
+} CoroutineTraceType;
+
+// NOTE: `stamp` is the cycle counter shifted up by 8, with the type in the
+//       low byte. A dump is a CoroutineTraceHeader followed by, for each
+//       thread, a CoroutineTraceThread and its `count` events, oldest first.
+typedef struct CoroutineTraceEvent  { unsigned long long stamp; int id; int fd; } CoroutineTraceEvent;
+typedef struct CoroutineTraceHeader { char magic[8]; unsigned version; unsigned threads; unsigned long long ns_per_tick; } CoroutineTraceHeader;
+typedef struct CoroutineTraceThread { unsigned thread; unsigned count; } CoroutineTraceThread;
+
+#define COROUTINE_TRACE_MAGIC   "CORTRACE"
+#define COROUTINE_TRACE_VERSION 1
+
+void coroutine_trace(int type, int id, int fd);
+// Writes every thread's ring to `fd`, with `ns_per_tick` in 32.32 fixed
+// point. Returns 0, or -1 with errno set.
+int  coroutine_trace_dump(int fd);
+
 
 #define coroutine_yield()        coroutine_switch(0,  CM_YIELD)
 #define coroutine_wait_read(fd)  coroutine_switch(fd, CM_WAIT_READ)
 #define coroutine_wait_write(fd) coroutine_switch(fd, CM_WAIT_WRITE)
 
+// Returns 1 if the fd became ready and 0 if `timeout_ms` passed first.
+#define coroutine_wait_read_timeout(fd, ms)  coroutine_wait_timeout(fd, CM_WAIT_READ,  ms)
+#define coroutine_wait_write_timeout(fd, ms) coroutine_wait_timeout(fd, CM_WAIT_WRITE, ms)
+
 #endif // COROUTINE_H_
 
 
@@ -35,12 +215,107 @@ void coroutine_destroy_all(void);
 
 
 #include <string.h>     // memcpy
+#include <stdlib.h>     // calloc, realloc, free
 #include <errno.h>      // errno
 #include <stdio.h>      // perror
+#include <stdint.h>     // uint64_t
+#include <unistd.h>     // read, write, close
+#include <time.h>       // clock_gettime
 #include <poll.h>       // poll
 
+#if defined(COROUTINE_POLL_EPOLL)
+    #if !defined(__linux__)
+    #error "COROUTINE_POLL_EPOLL is only supported on Linux"
+    #endif
+    #include <sys/epoll.h>  // epoll_create1, epoll_ctl, epoll_wait
+
+    #if !defined(COROUTINE_EPOLL_BATCH)
+    #define COROUTINE_EPOLL_BATCH 256
+    #endif
+#endif
+
+#if defined(COROUTINE_IO_URING)
+    #if !defined(__linux__)
+    #error "COROUTINE_IO_URING is only supported on Linux"
+    #endif
+    #include <linux/io_uring.h>  // io_uring_params, io_uring_sqe, io_uring_cqe
+    #include <sys/syscall.h>     // __NR_io_uring_setup, __NR_io_uring_enter
+    #include <sys/mman.h>        // mmap
+
+    #if !defined(COROUTINE_IO_URING_ENTRIES)
+    #define COROUTINE_IO_URING_ENTRIES 256
+    #endif
+#endif
+
 #if !defined(COROUTINE_MAX_COUNT)
-#define COROUTINE_MAX_COUNT 1024
+#define COROUTINE_MAX_COUNT (1 << 20)
+#endif
+
+#if !defined(COROUTINE_SIGNAL_WAKES)
+#define COROUTINE_SIGNAL_WAKES 16
+#endif
+
+#if !defined(COROUTINE_CHUNK_SIZE)
+#define COROUTINE_CHUNK_SIZE 1024
+#endif
+
+#if (COROUTINE_CHUNK_SIZE & (COROUTINE_CHUNK_SIZE - 1)) != 0
+#error "COROUTINE_CHUNK_SIZE must be a power of two"
+#endif
+
+#define COROUTINE__CHUNK_COUNT      ((COROUTINE_MAX_COUNT + COROUTINE_CHUNK_SIZE - 1) / COROUTINE_CHUNK_SIZE)
+#define COROUTINE__INITIAL_CAPACITY 64
+
+// NOTE: High, normal and low (see CF_PRIORITY_HIGH and CF_PRIORITY_LOW).
+#define COROUTINE__PRIORITY_COUNT 3
+
+// NOTE: A lower priority level that has been passed over this many times in
+//       a row gets to run one of its coroutines, so it can't starve.
+#if !defined(COROUTINE_PRIORITY_AGING)
+#define COROUTINE_PRIORITY_AGING 32
+#endif
+
+// NOTE: While coroutines can run, fds and timers are checked at most every
+//       this many switches. The interval shrinks when checks find something
+//       and grows back when they don't.
+#if !defined(COROUTINE_POLL_INTERVAL)
+#define COROUTINE_POLL_INTERVAL 64
+#endif
+
+// NOTE: Counters for coroutine_stats and coroutine_scheduler_stats. They're
+//       always on unless this is 0. The times cost one read of the cycle
+//       counter per switch, which can be slow under virtualization, so
+//       COROUTINE_STATS_TIME 0 keeps only the counts.
+#if !defined(COROUTINE_STATS)
+#define COROUTINE_STATS 1
+#endif
+
+#if !defined(COROUTINE_STATS_TIME)
+#define COROUTINE_STATS_TIME COROUTINE_STATS
+#endif
+
+// NOTE: With COROUTINE_TRACE, each scheduler records its events into a ring
+//       of this many (see coroutine_trace_dump).
+#if !defined(COROUTINE_TRACE_SIZE)
+#define COROUTINE_TRACE_SIZE (1 << 16)
+#endif
+
+#if (COROUTINE_TRACE_SIZE & (COROUTINE_TRACE_SIZE - 1)) != 0
+#error "COROUTINE_TRACE_SIZE must be a power of two"
+#endif
+
+// NOTE: With COROUTINE_STACK_PROFILE, new stacks are filled with a pattern so
+//       the deepest byte a coroutine touched can be found, and every switch
+//       checks for an overflow. The profile keeps at most this many entry
+//       functions.
+#if !defined(COROUTINE_STACK_PROFILE_ENTRIES)
+#define COROUTINE_STACK_PROFILE_ENTRIES 64
+#endif
+
+#if defined(COROUTINE_TRACE) || (COROUTINE_STATS && COROUTINE_STATS_TIME)
+#define COROUTINE__CYCLES 1
+#else
+#define COROUTINE__CYCLES 0
 #endif
 
 #if !defined(COROUTINE_IS_THREADED)
@@ -53,6 +328,46 @@ void coroutine_destroy_all(void);
 #define THREAD_LOCAL _Thread_local
 #endif
 
+#if defined(COROUTINE_WORK_STEALING)
+    #if !COROUTINE_IS_THREADED
+    #error "COROUTINE_WORK_STEALING requires COROUTINE_IS_THREADED"
+    #endif
+    #include <fcntl.h>  // fcntl
+
+    #if !defined(COROUTINE_STEAL_QUEUE_SIZE)
+    #define COROUTINE_STEAL_QUEUE_SIZE 64
+    #endif
+
+    #if !defined(COROUTINE_STEAL_MAX_THREADS)
+    #define COROUTINE_STEAL_MAX_THREADS 256
+    #endif
+
+    #if (COROUTINE_STEAL_QUEUE_SIZE & (COROUTINE_STEAL_QUEUE_SIZE - 1)) != 0
+    #error "COROUTINE_STEAL_QUEUE_SIZE must be a power of two"
+    #endif
+#endif
+
+// NOTE: By default a switch saves what the ABI says is callee-saved, apart
+//       from the floating-point control state: the integer registers, and
+//       d8-d15 on AArch64. COROUTINE_SWITCH_INTEGER_ONLY also skips d8-d15,
+//       and COROUTINE_SWITCH_FP_STATE adds the control state (MXCSR and the
+//       x87 control word, or FPCR), so each coroutine keeps e.g. its own
+//       rounding mode.
+#if defined(COROUTINE_SWITCH_INTEGER_ONLY) && defined(COROUTINE_SWITCH_FP_STATE)
+#error "COROUTINE_SWITCH_INTEGER_ONLY and COROUTINE_SWITCH_FP_STATE can't be combined"
+#endif
+
+// NOTE: A saved stack holds addresses into the shared stack of the scheduler
+//       it was saved from, so it can't be resumed by another one.
+#if defined(COROUTINE_SHARED_STACK) && defined(COROUTINE_WORK_STEALING)
+#error "COROUTINE_SHARED_STACK can't be combined with COROUTINE_WORK_STEALING"
+#endif
+
+// NOTE: Coroutines on a shared stack don't have a stack of their own to fill.
+#if defined(COROUTINE_SHARED_STACK) && defined(COROUTINE_STACK_PROFILE)
+#error "COROUTINE_SHARED_STACK can't be combined with COROUTINE_STACK_PROFILE"
+#endif
+
 
 #if !defined(COROUTINE_STACK_SIZE)
 #define COROUTINE_STACK_SIZE (8*4096)
@@ -65,462 +380,3874 @@ typedef union Coroutine {
         void* stack_base;
         void* stack_top;
         void (*destroy)(void*, size_t);
+        size_t arg_size;
+        unsigned generation;    // Bumped each time the slot is freed.
+        int sleep_index;
+        int run_index;          // Where it is in its run ring, if it's queued.
+        int io_result;
+        int timer_index;
+        int timed_out;
+        int flags;
+        uint64_t deadline;
+#if defined(COROUTINE_SHARED_STACK)
+        void* saved;            // Copy of [stack_ptr, stack_top) while another coroutine is on the stack.
+        size_t saved_capacity;
+#endif
+#if defined(COROUTINE_POLL_EPOLL)
+        int epoll_next;         // Links to the others waiting on the same direction of its fd.
+        int epoll_prev;
+#endif
+        // NOTE: Links in the CoroutineWaitQueue it's parked on, if any. They're
+        //       only touched under the lock of whatever owns the queue.
+        struct CoroutineWaitQueue* wait_queue;
+        union Coroutine*           wait_next;
+        union Coroutine*           wait_prev;
+        void*                      wait_inbox;  // Scheduler (its inbox with threads) to wake it up through.
+        int                        wait_id;
+        CoroutineWaitQueue         joiners;     // Parked in coroutine_join on this scheduler.
+#if defined(COROUTINE_STACK_PROFILE)
+        void (*entry)(void*);   // What the stack profile is kept by.
+#endif
+#if COROUTINE_STATS
+        uint64_t switches;
+        uint64_t run_ticks;
+        uint64_t wait_ticks;
+        uint64_t wait_since;    // When it started waiting, or 0.
+#endif
     };
     int next_free;
 } Coroutine;
 
 
-/*
-g_polls       Ordered parallel to g_sleeping
-g_sleeping    Unordered with indices to g_coroutines
-g_active      Unordered with indices to g_coroutines
-g_coroutines  Ordered in insertion order (with intrusive free-list?)
-*/
-THREAD_LOCAL struct pollfd  g_polls[COROUTINE_MAX_COUNT]      = { 0 };
-THREAD_LOCAL int            g_sleeping[COROUTINE_MAX_COUNT]   = { 0 };
-THREAD_LOCAL int            g_active[COROUTINE_MAX_COUNT]     = { 0 };
-THREAD_LOCAL Coroutine      g_coroutines[COROUTINE_MAX_COUNT] = { 0 };
+#if defined(COROUTINE_IO_URING)
+// NOTE: With a ring, fd waits become IORING_OP_POLL_ADD and coroutine_read/write
+//       become IORING_OP_READ/WRITE. Submissions are queued in the ring and
+//       handed to the kernel once per pass over the active coroutines, or when
+//       nothing is left to run, together with the wait for completions.
+typedef struct CoroutineRing {
+    int       fd;           // -1 if not set up yet, -2 if io_uring is unavailable.
+    unsigned  pending;      // Queued submissions not yet handed to the kernel.
+    int       in_flight;    // Coroutines waiting in CM_WAIT_COMPLETION.
+    int       tick_budget;  // Switches left until the queued submissions are flushed.
+    int       notify_armed; // Whether the steal notification pipe has a poll queued.
+    int       inbox_armed;  // Whether the inbox has a poll queued.
+    unsigned  sq_entries;
+    unsigned  sq_mask;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_flags;
+    unsigned  cq_mask;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void*     ring;
+    size_t    ring_size;
+} CoroutineRing;
+
+// NOTE: Completions of IORING_OP_READ/WRITE are tagged with this bit, the
+//       other completions are readiness of an fd a coroutine sleeps on.
+//       Completions of cancellations carry COROUTINE__RING_IGNORE.
+#define COROUTINE__RING_COMPLETION (1ull << 63)
+#define COROUTINE__RING_IGNORE     (~0ull)
+#define COROUTINE__RING_NOTIFY     (~1ull)
+#define COROUTINE__RING_INBOX      (~2ull)
+#endif
 
-THREAD_LOCAL int g_sleep_count     = 0;
-THREAD_LOCAL int g_active_count    = 1;
-THREAD_LOCAL int g_coroutine_count = 1;
-THREAD_LOCAL int g_current_active  = 0;
-THREAD_LOCAL int g_first_free      = 0;
+#if defined(COROUTINE_POLL_EPOLL)
+// NOTE: epoll keeps one registration per fd, so the scheduler keeps the
+//       coroutines waiting on each direction of an fd in a list, indexed by
+//       the fd and linked through the coroutines (-1 if it's empty). They're
+//       unlinked when they stop sleeping, however they're woken up.
+typedef struct CoroutineEpollFd {
+    int readers;
+    int writers;
+} CoroutineEpollFd;
+#endif
 
+#if defined(COROUTINE_WORK_STEALING)
+// NOTE: Every scheduler that creates a stealable coroutine owns one of these
+//       Chase-Lev deques. While another scheduler is idle, the owner moves
+//       runnable coroutines it can spare to the bottom of its deque and idle
+//       schedulers steal them from the top. A queued coroutine is a copy of
+//       its Coroutine written just below its saved registers, so ownership of
+//       the stack moves with a single pointer and nothing is allocated.
+typedef struct CoroutineStealQueue {
+    int64_t    top;          // Next entry to steal, only advanced with a CAS.
+    int64_t    bottom;       // Next free entry, only written by the owner.
+    Coroutine* entries[COROUTINE_STEAL_QUEUE_SIZE];
+    int        owned;        // Whether a scheduler uses this queue.
+    int        idle;         // Whether the owner is blocked waiting for work.
+    int        has_pipe;
+    int        notify[2];    // Wakes the owner up when it's idle.
+} CoroutineStealQueue;
 
-#if defined(COROUTINE_STACK_MMAP)
-    #include <sys/mman.h>
-    #ifdef __APPLE__
-        #define MAP_STACK 0
-        #define MAP_GROWSDOWN 0
+// NOTE: Queues and their pipes are never freed, so a late notification can't
+//       write to an fd that has been closed and reused.
+static CoroutineStealQueue g_steal_queues[COROUTINE_STEAL_MAX_THREADS];
+static int                 g_steal_queue_count = 0;  // High-water mark of owned queues.
+static int                 g_steal_idle_count  = 0;  // Schedulers with `idle` set.
+#endif
+
+
+#if COROUTINE_IS_THREADED
+    #if defined(__linux__)
+    #include <sys/eventfd.h>
     #endif
+    #include <fcntl.h>  // fcntl
+    #include <sched.h>  // sched_yield
 
-    static void* coroutine_stack_allocate(size_t size) {
-        void* ptr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE|MAP_STACK|MAP_GROWSDOWN, -1, 0);
-        return ptr == MAP_FAILED ? NULL : ptr;
-    }
+    #if !defined(COROUTINE_MAX_THREADS)
+    #define COROUTINE_MAX_THREADS 256
+    #endif
 
-    static void coroutine_stack_deallocate(void* ptr, size_t size) {
-        munmap(ptr, size);
-    }
-#elif defined(COROUTINE_STACK_MALLOC)
-    #include <stdlib.h>
+// NOTE: Lets other threads wake up coroutines parked on this scheduler. The
+//       ids are added under `lock` and only the first waker after a drain
+//       signals the fd, so a burst of wake-ups costs one write and one read.
+//       Like the steal queues, inboxes and their fds are never freed.
+typedef struct CoroutineInbox {
+    int  lock;
+    int  count;
+    int  capacity;
+    int* ids;
+    int  signalled;     // The fd has been written since the last drain.
+    int  owned;
+    int  has_fd;
+    int  fd[2];         // Read and write end, the same eventfd on Linux.
+} CoroutineInbox;
 
-    #define coroutine_stack_allocate malloc
-    void coroutine_stack_deallocate(void* ptr, size_t size) {
-        free(ptr);
-    }
-#elif defined(coroutine_stack_allocate) && defined(coroutine_stack_deallocate)
-#else
-    #error "Must define an allocator/deallocator"
+static CoroutineInbox g_inboxes[COROUTINE_MAX_THREADS];
 #endif
 
 
-#if !defined(COROUTINE_LOG)
-#define COROUTINE_LOG(id, message, ...)
+// NOTE: Per-scheduler state that other threads may read, i.e. the stats and
+//       trace rings, is kept in one of these slots.
+#if COROUTINE_IS_THREADED
+#define COROUTINE__SCHEDULER_SLOTS COROUTINE_MAX_THREADS
+#else
+#define COROUTINE__SCHEDULER_SLOTS 1
 #endif
 
+#if COROUTINE__CYCLES && defined(__x86_64__)
+static uint64_t g_ns_per_tick = 0;  // 32.32 fixed point, measured on first use.
+#endif
 
-static int safety_check(void) {
-    for (int i = 0; i < g_active_count - 1; i++) {
-        for (int j = i + 1; j < g_active_count; j++) {
-            COROUTINE_ASSERT(g_active[i] != g_active[j]);
-        }
-    }
+#if COROUTINE_STATS
+// NOTE: A scheduler's counters live in a slot other threads can read for
+//       coroutine_scheduler_stats_all, so they're only written by the owner
+//       with relaxed stores. Times are in cycle counter ticks until queried.
+//       If all slots are taken, the scheduler counts in its `local_counters`.
+typedef struct CoroutineCounters {
+    int      owned;
+    uint64_t switches;
+    uint64_t run_ticks;
+    uint64_t idle_ticks;
+    uint64_t polls;
+    uint64_t ready;
+    uint64_t creates;
+    uint64_t exits;
+    int      active;
+    int      peak_active;
+    int      sleeping;
+    int      peak_sleeping;
+} CoroutineCounters;
 
-    for (int i = 0; i < g_sleep_count - 1; i++) {
-        for (int j = i + 1; j < g_sleep_count; j++) {
-            COROUTINE_ASSERT(g_sleeping[i] != g_sleeping[j]);
-        }
-    }
+static CoroutineCounters g_counter_slots[COROUTINE__SCHEDULER_SLOTS];
 
-    COROUTINE_ASSERT(g_coroutines[0].stack_base == NULL);
-    for (int i = 1; i < g_coroutine_count - 1; i++) {
-        Coroutine* coroutine = &g_coroutines[i];
-        COROUTINE_ASSERT(coroutine->stack_base != NULL);
-    }
+#define COROUTINE__COUNT(field, n) __atomic_store_n(&g_scheduler->counters->field, g_scheduler->counters->field + (n), __ATOMIC_RELAXED)
+#define COROUTINE__PEAK(field, value)                                           \
+    do {                                                                        \
+        if ((value) > g_scheduler->counters->field)                                        \
+            __atomic_store_n(&g_scheduler->counters->field, (value), __ATOMIC_RELAXED);    \
+    } while (0)
+#else
+#define COROUTINE__COUNT(field, n)
+#define COROUTINE__PEAK(field, value)
+#endif
 
-    return 1;
-}
 
+#if defined(COROUTINE_TRACE)
+// NOTE: Only the owner writes to its ring, and publishes each event by
+//       bumping `head`. A reader copies the last COROUTINE_TRACE_SIZE events
+//       and then drops those the owner might have overwritten meanwhile.
+//       Rings are never freed, so they can be dumped after their thread is
+//       gone, until another scheduler takes the slot.
+typedef struct CoroutineTraceRing {
+    int                 owned;
+    uint64_t            head;   // Events written so far.
+    CoroutineTraceEvent events[COROUTINE_TRACE_SIZE];
+} CoroutineTraceRing;
 
-static void coroutine__return_from_current_coroutine(void);
-int coroutine_create(void (*f)(void*), const void* data, size_t size, void (*on_destroy)(void*, size_t))
-{
-    COROUTINE_ASSERT(safety_check());
+static CoroutineTraceRing* g_trace_rings[COROUTINE__SCHEDULER_SLOTS];
+#endif
 
-    // NOTE: Rounding up size to a multiple of 16 as the stack is required to
-    //       be 16-byte aligned on certain architectures.
-    size = (size + 15) & ~(size_t)15;
 
-    if (g_first_free != 0) {
-        int free_index = g_first_free;
-        Coroutine* free = &g_coroutines[free_index];
-        g_active[g_active_count++] = free_index;
-        g_first_free = free->next_free;
-        free->destroy = on_destroy;
-
-        char* stack_top = (char*)free->stack_top;
-        char* ptr_top   = (char*)stack_top - size;
-        memcpy(ptr_top, data, size);
-
-        void** ptr = (void*) ptr_top;
-
-        #if defined(__x86_64__)
-                *(--ptr) = (void*) coroutine__return_from_current_coroutine;
-                *(--ptr) = (void*) f;
-                *(--ptr) = (void*) ptr_top;         // push rdi
-                *(--ptr) = 0;                       // push rbx
-                *(--ptr) = 0;                       // push rbp
-                *(--ptr) = 0;                       // push r12
-                *(--ptr) = 0;                       // push r13
-                *(--ptr) = 0;                       // push r14
-                *(--ptr) = 0;                       // push r15
-        #elif defined(__aarch64__)
-                *(--ptr) = (void*) ptr_top;
-                *(--ptr) = (void*) coroutine__return_from_current_coroutine;
-                *(--ptr) = (void*) f; // push x30
-                *(--ptr) = 0;   // push x29
-                *(--ptr) = 0;   // push x28
-                *(--ptr) = 0;   // push x27
-                *(--ptr) = 0;   // push x26
-                *(--ptr) = 0;   // push x25
-                *(--ptr) = 0;   // push x24
-                *(--ptr) = 0;   // push x23
-                *(--ptr) = 0;   // push x22
-                *(--ptr) = 0;   // push x21
-                *(--ptr) = 0;   // push x20
-                *(--ptr) = 0;   // push x19
-                *(--ptr) = 0;   // push v15
-                *(--ptr) = 0;
-                *(--ptr) = 0;   // push v14
-                *(--ptr) = 0;
-                *(--ptr) = 0;   // push v13
-                *(--ptr) = 0;
-                *(--ptr) = 0;   // push v12
-                *(--ptr) = 0;
-                *(--ptr) = 0;   // push v11
-                *(--ptr) = 0;
-                *(--ptr) = 0;   // push v10
-                *(--ptr) = 0;
-                *(--ptr) = 0;   // push v09
-                *(--ptr) = 0;
-                *(--ptr) = 0;   // push v08
-                *(--ptr) = 0;
-        #else
-        #error "Unsupported platform"
-        #endif
-
-        free->stack_ptr = ptr;
-
-        COROUTINE_ASSERT(safety_check());
-        return free_index;
-    } else if (g_coroutine_count >= COROUTINE_MAX_COUNT) {
-        return -1;
-    }
+/*
+polls       Ordered parallel to sleeping
+sleeping    Unordered with indices to coroutines (Coroutine.sleep_index points back)
+run         FIFO rings per priority level with indices to coroutines that can run, except current (Coroutine.run_index points back)
+timers      Min-heap on Coroutine.deadline with indices to coroutines (Coroutine.timer_index points back)
+coroutines  Ordered in insertion order (with intrusive free-list?)
 
-    size_t stack_size = COROUTINE_STACK_SIZE;
-    void*  stack = coroutine_stack_allocate(stack_size);
-    // TODO: Assert is 16 byte aligned.
+NOTE: Nothing is allocated until a scheduler is first used. The dense arrays
+      hold at most one entry per coroutine, so they're reallocated to
+      `capacity` as the table grows. Coroutines live in fixed-size chunks
+      that are never moved, so ids and Coroutine pointers stay valid.
 
-    char* stack_top = (char*)stack + stack_size;
-    char* ptr_top   = stack_top - size;
-    memcpy(ptr_top, data, size);
+NOTE: A coroutine taken out of the middle of a run ring leaves -1 behind,
+      which is skipped once it reaches the front. The rings are twice
+      `capacity`, so one that fills up is at least half holes and packing it
+      costs O(1) per hole.
+*/
+struct CoroutineScheduler {
+    int current;
+    int active_count;       // Coroutines that can run, including `current` if it can.
+    int handoff;            // Runnable but not queued; runs next (see coroutine_switch_to).
+    int poll_interval;
+    int poll_countdown;
+    int coroutine_count;
+    int first_free;
+    int idle_stacks;        // Free slots with a committed stack.
+    int park_count;
+    int sleep_count;
+    int timer_count;
+    int capacity;
 
-    void** ptr = (void*) ptr_top;
+    int  run_head[COROUTINE__PRIORITY_COUNT];
+    int  run_count[COROUTINE__PRIORITY_COUNT];    // Entries, including holes.
+    int  run_holes[COROUTINE__PRIORITY_COUNT];
+    int  run_skipped[COROUTINE__PRIORITY_COUNT];
+    int* run[COROUTINE__PRIORITY_COUNT];
 
-    #if defined(__x86_64__)
-        *(--ptr) = (void*) coroutine__return_from_current_coroutine;
-        *(--ptr) = (void*) f;
-        *(--ptr) = (void*) ptr_top;         // push rdi
-        *(--ptr) = 0;                       // push rbx
-        *(--ptr) = 0;                       // push rbp
-        *(--ptr) = 0;                       // push r12
-        *(--ptr) = 0;                       // push r13
-        *(--ptr) = 0;                       // push r14
-        *(--ptr) = 0;                       // push r15
-    #elif defined(__aarch64__)
-        *(--ptr) = (void*) ptr_top;
-        *(--ptr) = (void*) coroutine__return_from_current_coroutine;
-        *(--ptr) = (void*) f; // push x30
-        *(--ptr) = 0;   // push x29
-        *(--ptr) = 0;   // push x28
-        *(--ptr) = 0;   // push x27
-        *(--ptr) = 0;   // push x26
-        *(--ptr) = 0;   // push x25
-        *(--ptr) = 0;   // push x24
-        *(--ptr) = 0;   // push x23
-        *(--ptr) = 0;   // push x22
-        *(--ptr) = 0;   // push x21
-        *(--ptr) = 0;   // push x20
-        *(--ptr) = 0;   // push x19
-        *(--ptr) = 0;   // push v15
-        *(--ptr) = 0;
-        *(--ptr) = 0;   // push v14
-        *(--ptr) = 0;
-        *(--ptr) = 0;   // push v13
-        *(--ptr) = 0;
-        *(--ptr) = 0;   // push v12
-        *(--ptr) = 0;
-        *(--ptr) = 0;   // push v11
-        *(--ptr) = 0;
-        *(--ptr) = 0;   // push v10
-        *(--ptr) = 0;
-        *(--ptr) = 0;   // push v09
-        *(--ptr) = 0;
-        *(--ptr) = 0;   // push v08
-        *(--ptr) = 0;
-    #else
-    #error "Unsupported platform! Only supports x86_64 or Aarch64."
-    #endif
+    struct pollfd* polls;   // `capacity`+2 for the steal and inbox notifications.
+    int*           sleeping;
+    int*           timers;
 
+#if defined(COROUTINE_STACK_MMAP)
+    struct CoroutineStackRegion* stack_available;   // Owned regions that might have a free slot.
+#endif
 
-    Coroutine coroutine = {
-        .stack_base = stack,
-        .stack_ptr = ptr,
-        .stack_top = stack_top,
-        .destroy = on_destroy,
-    };
+#if defined(COROUTINE_SHARED_STACK)
+    // NOTE: All coroutines of a scheduler run on `shared_stack`, but only the
+    //       frames of `shared_owner` are on it. The others are copied out to
+    //       their `saved` buffer when they lose it and copied back in when
+    //       they're resumed, which is done from `shared_scratch` so the copy
+    //       can't overwrite the frame doing it.
+    char* shared_stack;
+    char* shared_scratch;
+    int   shared_owner;
+#endif
 
-    g_active[g_active_count++] = g_coroutine_count;
-    g_coroutines[g_coroutine_count++] = coroutine;
+#if defined(COROUTINE_POLL_EPOLL)
+    // NOTE: Each waiting fd is registered with EPOLLONESHOT for the union of
+    //       the directions waited on and carries the fd as its data, so a wait
+    //       costs one epoll_ctl and readiness comes back as a list of exactly
+    //       the fds whose waiters became ready.
+    int                epoll_fd;
+    struct epoll_event epoll_events[COROUTINE_EPOLL_BATCH];
+    CoroutineEpollFd*  epoll_waiters;
+    int                epoll_waiter_capacity;
+#endif
 
-    COROUTINE_ASSERT(safety_check());
-    return g_coroutine_count-1;
-}
+#if defined(COROUTINE_IO_URING)
+    CoroutineRing ring;
+#endif
 
-void coroutine_destroy_all(void) {
-    COROUTINE_ASSERT(safety_check());
-    COROUTINE_ASSERT(coroutine_id() == 0);
+#if defined(COROUTINE_WORK_STEALING)
+    CoroutineStealQueue* steal;
+    int                  steal_waiting;     // We've set our `idle` flag.
+    int                  steal_notified;    // Our pipe was reported readable.
+#if defined(COROUTINE_POLL_EPOLL)
+    int                  steal_epoll;       // Our pipe is in the epoll set.
+#endif
+#endif
 
-    for (int i = 1; i < g_coroutine_count; i++) {
-        Coroutine* coroutine = &g_coroutines[i];
-        COROUTINE_ASSERT(coroutine->stack_base != NULL);
-        coroutine_stack_deallocate(coroutine->stack_base, (char*)coroutine->stack_top - (char*)coroutine->stack_base);
-        COROUTINE_LOG(0, "Destroying coroutine %d at %p", i, coroutine->stack_base);
-    }
+#if COROUTINE_IS_THREADED
+    CoroutineInbox* inbox;
+#if defined(COROUTINE_POLL_EPOLL)
+    int             inbox_epoll;            // Our fd is in the epoll set.
+#endif
+#endif
 
-    g_sleep_count     = 0;
-    g_active_count    = 1;
-    g_coroutine_count = 1;
-    g_current_active  = 0;
-    g_first_free      = 0;
-}
+#if COROUTINE_STATS
+    CoroutineCounters* counters;
+    CoroutineCounters  local_counters;
+    uint64_t           stats_since;         // When `current` was resumed or the last idle wait ended.
+#endif
 
+#if defined(COROUTINE_TRACE)
+    CoroutineTraceRing* trace;
+#endif
 
-#if defined(__x86_64__)
-// rdi, rsi, rdx, rcx, r8, and r9 are arguments
-// r12, r13, r14, r15, rbx, rsp, rbp are the callee-saved registers
-#define STORE_REGISTERS                             \
-    "    pushq %rdi\n"                              \
-    "    pushq %rbp\n"                              \
-    "    pushq %rbx\n"                              \
-    "    pushq %r12\n"                              \
-    "    pushq %r13\n"                              \
-    "    pushq %r14\n"                              \
-    "    pushq %r15\n"                              \
-    "    movq %rsp, %rdx\n"                         \
-    "    jmp coroutine__switch_context\n"
-#define RESTORE_REGISTERS                           \
-    "    movq %rdi, %rsp\n"                         \
-    "    popq %r15\n"                               \
-    "    popq %r14\n"                               \
-    "    popq %r13\n"                               \
-    "    popq %r12\n"                               \
-    "    popq %rbx\n"                               \
-    "    popq %rbp\n"                               \
-    "    popq %rdi\n"                               \
-    "    ret\n"
-#elif defined(__aarch64__)
-// x19 to x28 are callee-saved
-// x0 to x7 are arguments/return values
-#define STORE_REGISTERS                                                         \
-    "sub sp,   sp, #240\n"                                                      \
-    "stp q8,   q9, [sp, #0]\n"                                                  \
-    "stp q10, q11, [sp, #32]\n"                                                 \
-    "stp q12, q13, [sp, #64]\n"                                                 \
-    "stp q14, q15, [sp, #96]\n"                                                 \
-    "stp x19, x20, [sp, #128]\n"                                                \
-    "stp x21, x22, [sp, #144]\n"                                                \
-    "stp x23, x24, [sp, #160]\n"                                                \
-    "stp x25, x26, [sp, #176]\n"                                                \
-    "stp x27, x28, [sp, #192]\n"                                                \
-    "stp x29, x30, [sp, #208]\n"                                                \
-    "str x30, [sp, #224]\n"                                                     \
-    "str x0,  [sp, #232]\n"                                                     \
-    "mov x2, sp\n"                                                              \
-    "b coroutine__switch_context\n"
-#define RESTORE_REGISTERS                                                       \
-    "mov sp, x0\n"                                                              \
-    "ldp q8,   q9, [sp, #0]\n"                                                  \
-    "ldp q10, q11, [sp, #32]\n"                                                 \
-    "ldp q12, q13, [sp, #64]\n"                                                 \
-    "ldp q14, q15, [sp, #96]\n"                                                 \
-    "ldp x19, x20, [sp, #128]\n"                                                \
-    "ldp x21, x22, [sp, #144]\n"                                                \
-    "ldp x23, x24, [sp, #160]\n"                                                \
-    "ldp x25, x26, [sp, #176]\n"                                                \
-    "ldp x27, x28, [sp, #192]\n"                                                \
-    "ldp x29, x30, [sp, #208]\n"                                                \
-    "mov x1, x30\n"                                                             \
-    "ldr x30, [sp, #224]\n"                                                     \
-    "ldr x0,  [sp, #232]\n"                                                     \
-    "add sp, sp, #240\n"                                                        \
-    "ret x1\n"
+    Coroutine* coroutines[COROUTINE__CHUNK_COUNT];
+};
+
+#if defined(COROUTINE_POLL_EPOLL)
+#define COROUTINE__EPOLL_DEFAULTS .epoll_fd = -1,
 #else
-#error "Unsupported platform! Only supports x86_64 or Aarch64."
+#define COROUTINE__EPOLL_DEFAULTS
 #endif
 
+#if defined(COROUTINE_IO_URING)
+#define COROUTINE__RING_DEFAULTS .ring = { .fd = -1 },
+#else
+#define COROUTINE__RING_DEFAULTS
+#endif
 
-__attribute__((naked))
-void coroutine_switch(__attribute__((unused)) int fd, __attribute__((unused)) CoroutineMode mode)
-{
-    // @arch - Push the `arg` on the stack and then all callee-saved registers. Then jump to `coroutine__switch_context`.
-    __asm__ volatile (STORE_REGISTERS);
+#define COROUTINE__SCHEDULER_DEFAULTS {         \
+    .active_count    = 1,                       \
+    .handoff         = -1,                      \
+    .poll_interval   = 1,                       \
+    .poll_countdown  = 1,                       \
+    .coroutine_count = 1,                       \
+    COROUTINE__EPOLL_DEFAULTS                   \
+    COROUTINE__RING_DEFAULTS                    \
 }
 
-__attribute__((naked))
-static void coroutine__restore_context(__attribute__((unused)) void *rsp)
-{
-    // @arch - Set the stack to `rsp`, restore all callee-saved registers and set the parameter in `rdi`.
-    __asm__ volatile (RESTORE_REGISTERS);
+// NOTE: Every thread starts out on its own default scheduler, and the state
+//       of the one it's on is only reached through `g_scheduler`, so a
+//       thread can switch between schedulers (see coroutine_scheduler_enter).
+THREAD_LOCAL CoroutineScheduler g_default_scheduler = COROUTINE__SCHEDULER_DEFAULTS;
+
+#if COROUTINE_IS_THREADED
+// NOTE: The address of a thread-local isn't a constant, so the pointer starts
+//       out NULL and coroutine__init points it at the default. Until then the
+//       default is looked up out of line, which keeps the common path to a
+//       load and a branch that's never taken.
+THREAD_LOCAL CoroutineScheduler* g_current_scheduler = NULL;
+
+__attribute__((const, noinline, cold))
+static CoroutineScheduler* coroutine__default_scheduler(void) {
+    return &g_default_scheduler;
 }
 
+#define g_scheduler (__builtin_expect(g_current_scheduler != NULL, 1) ? g_current_scheduler : coroutine__default_scheduler())
+#else
+static CoroutineScheduler* g_current_scheduler = &g_default_scheduler;
 
-static void coroutine__poll(void) {
-    COROUTINE_ASSERT(safety_check());
-    if (g_sleep_count == 0) {
-        COROUTINE_LOG(g_active[g_current_active], "none are sleeping%s", "");
-        return;
-    }
+#define g_scheduler g_current_scheduler
+#endif
 
-    int timeout = g_active_count == 0 ? -1 : 0;
-    while (poll(g_polls, g_sleep_count, timeout) < 0) {
-        // NOTE: We got interrupted but not by a wake-up signal.
-        if (errno == EINTR && g_active_count > 0) {
-            break;
-        } else {
-            perror("poll");
-            COROUTINE_LOG(g_active[g_current_active], "poll returned errno %d with %d active", errno, g_active_count);
-        }
-    }
 
-    for (int i = 0; i < g_sleep_count;) {
-        int id = g_sleeping[i];
-        if (g_polls[i].revents != 0) {
-            int last_sleep_id = --g_sleep_count;
-            g_polls[i]    = g_polls[last_sleep_id];
-            g_sleeping[i] = g_sleeping[last_sleep_id];
+#if defined(COROUTINE_STACK_MMAP)
+    #include <sys/mman.h>
+    #ifndef MAP_NORESERVE
+        #define MAP_NORESERVE 0
+    #endif
 
-            g_active[g_active_count++] = id;
-        } else {
-            i += 1;
-        }
-    }
-    COROUTINE_ASSERT(safety_check());
-}
+    #if !defined(COROUTINE_STACK_GUARD_SIZE)
+    #define COROUTINE_STACK_GUARD_SIZE 4096
+    #endif
 
+    #if !defined(COROUTINE_STACK_ARENA_SLOTS)
+    #define COROUTINE_STACK_ARENA_SLOTS 1024
+    #endif
 
-extern void coroutine__switch_context(int fd, CoroutineMode mode, void *rsp) __asm__("coroutine__switch_context");
-void coroutine__switch_context(int fd, CoroutineMode mode, void *rsp)
-{
-    COROUTINE_ASSERT(safety_check());
+    #if !defined(COROUTINE_STACK_MAX_REGIONS)
+    #define COROUTINE_STACK_MAX_REGIONS 1024
+    #endif
 
-    // Set current context rsp
-    int active_id = g_active[g_current_active];
-    Coroutine* coroutine = &g_coroutines[active_id];
-    coroutine->stack_ptr = rsp;
+    // NOTE: Each guard splits the region into another mapping and the kernel
+    //       limits those per process (vm.max_map_count, 65530 by default), so
+    //       only this many slots get one, leaving room for everything else.
+    #if !defined(COROUTINE_STACK_MAX_GUARDS)
+    #define COROUTINE_STACK_MAX_GUARDS 16384
+    #endif
 
-    COROUTINE_ASSERT(coroutine->stack_base == NULL || (coroutine->stack_base <= coroutine->stack_ptr && coroutine->stack_ptr <= coroutine->stack_top));
+    // NOTE: Each scheduler carves its stacks out of regions that are reserved
+    //       up front as PROT_NONE. A slot is a guard followed by the stack,
+    //       and only the stack is made accessible when the slot is first
+    //       handed out, so its pages are committed as they're touched and an
+    //       overflow faults on the guard instead of running into a neighbour.
+    //       Regions are never unmapped: a stack might have been stolen by
+    //       another scheduler, which then frees it through `remote_free`.
+    //
+    //       A region starts at a multiple of its power-of-two size, with a
+    //       page holding a pointer to its CoroutineStackRegion before the
+    //       slots, so a stack finds its region from its address alone.
+    typedef struct CoroutineStackRegion {
+        char*     base;         // The first slot, a page past the start of the region.
+        size_t    slot_size;    // Guard and stack, a multiple of the page size.
+        size_t    guard_size;
+        int       carved;       // Slots made accessible so far.
+        int       unguarded;    // The slots past `carved` are accessible too.
+        int       first_free;   // Free slots (only touched by the owner), or -1.
+        int       remote_free;  // Slots freed by other threads, or -1.
+        uintptr_t owner;        // Scheduler using the region, or 0.
+        int       available;    // On the owner's `stack_available` list.
+        struct CoroutineStackRegion* next_available;
+        int       next[COROUTINE_STACK_ARENA_SLOTS];
+    } CoroutineStackRegion;
 
-    switch (mode) {
-        case CM_YIELD: {
-            COROUTINE_LOG(g_active[g_current_active], "yielding to coroutine %02d", g_active[g_current_active]);
+    static CoroutineStackRegion* g_stack_regions[COROUTINE_STACK_MAX_REGIONS];
+    static int                   g_stack_region_count = 0;
+    static int                   g_stack_guard_count  = 0;
 
-            // Go to next coroutine
-            g_current_active += 1;
-            g_current_active %= g_active_count;
-        } break;
-        case CM_WAIT_READ:
-        case CM_WAIT_WRITE: {
-            COROUTINE_LOG(g_active[g_current_active], "is waiting for %s", (mode == CM_WAIT_READ) ? "read" : "write");
-
-            // Put current coroutine to sleep
-            struct pollfd pfd = {
-                .fd = fd,
-                .events = (mode == CM_WAIT_READ) ? POLLRDNORM : POLLWRNORM,
-                .revents = 0
-            };
-
-            g_sleeping[g_sleep_count] = active_id;
-            g_polls[g_sleep_count] = pfd;
-            g_sleep_count += 1;
-
-            COROUTINE_ASSERT(g_active_count >= 0);
-            if (g_active_count > 0)
-                g_active[g_current_active] = g_active[--g_active_count];
-        } break;
+    #define COROUTINE__STACK_OWNER ((uintptr_t)g_scheduler)
+
+    static size_t coroutine__page_round(size_t size) {
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        return (size + page - 1) & ~(page - 1);
     }
 
-    coroutine__poll();
+    static size_t coroutine__stack_slot_size(size_t size) {
+        return coroutine__page_round(COROUTINE_STACK_GUARD_SIZE) + coroutine__page_round(size);
+    }
 
-    active_id = g_active[g_current_active];
-    coroutine = &g_coroutines[active_id];
-    coroutine__restore_context(coroutine->stack_ptr);
-}
+    // NOTE: What regions for stacks of `size` are aligned to, their size
+    //       rounded up to a power of two.
+    static size_t coroutine__stack_region_align(size_t size) {
+        size_t span  = coroutine__page_round(1) + coroutine__stack_slot_size(size) * COROUTINE_STACK_ARENA_SLOTS;
+        size_t align = coroutine__page_round(1);
+        while (align < span)
+            align <<= 1;
+        return align;
+    }
 
+    // NOTE: Maps enough to find an aligned start in it and unmaps the rest.
+    static char* coroutine__stack_region_reserve(size_t span, size_t align) {
+        size_t size = span + align - coroutine__page_round(1);
+        char*  mapping = mmap(NULL, size, PROT_NONE, MAP_ANONYMOUS|MAP_PRIVATE|MAP_NORESERVE, -1, 0);
+        if (mapping == MAP_FAILED)
+            return NULL;
 
-static void coroutine__return_from_current_coroutine(void)
+        char* start = (char*)(((uintptr_t)mapping + align - 1) & ~(uintptr_t)(align - 1));
+        if (start > mapping)
+            munmap(mapping, (size_t)(start - mapping));
+        if (start + span < mapping + size)
+            munmap(start + span, (size_t)(mapping + size - (start + span)));
+        return start;
+    }
+
+    static CoroutineStackRegion* coroutine__stack_region_map(size_t size) {
+        int index = __atomic_fetch_add(&g_stack_region_count, 1, __ATOMIC_ACQ_REL);
+        if (index >= COROUTINE_STACK_MAX_REGIONS) {
+            __atomic_fetch_sub(&g_stack_region_count, 1, __ATOMIC_ACQ_REL);
+            return NULL;
+        }
+
+        CoroutineStackRegion* region = calloc(1, sizeof(CoroutineStackRegion));
+        size_t page      = coroutine__page_round(1);
+        size_t slot_size = coroutine__stack_slot_size(size);
+        size_t span      = page + slot_size * COROUTINE_STACK_ARENA_SLOTS;
+        char*  start     = coroutine__stack_region_reserve(span, coroutine__stack_region_align(size));
+        if (start != NULL && mprotect(start, page, PROT_READ|PROT_WRITE) != 0) {
+            munmap(start, span);
+            start = NULL;
+        }
+        if (region == NULL || start == NULL) {
+            perror("coroutine__stack_region_map");
+            free(region);
+            region = NULL;
+        } else {
+            *(CoroutineStackRegion**)start = region;
+            region->base        = start + page;
+            region->slot_size   = slot_size;
+            region->guard_size  = coroutine__page_round(COROUTINE_STACK_GUARD_SIZE);
+            region->first_free  = -1;
+            region->remote_free = -1;
+            region->owner       = COROUTINE__STACK_OWNER;
+        }
+
+        // NOTE: Published even on failure, so the slot count stays in sync.
+        __atomic_store_n(&g_stack_regions[index], region, __ATOMIC_RELEASE);
+        return region;
+    }
+
+    static void* coroutine__stack_region_take(CoroutineStackRegion* region, size_t size) {
+        if (region->first_free < 0)
+            region->first_free = __atomic_exchange_n(&region->remote_free, -1, __ATOMIC_ACQUIRE);
+
+        int slot = region->first_free;
+        if (slot >= 0) {
+            region->first_free = region->next[slot];
+        } else if (region->carved < COROUTINE_STACK_ARENA_SLOTS) {
+            slot = region->carved;
+            char* guard = region->base + (size_t)slot * region->slot_size;
+            char* stack = guard + region->guard_size;
+            int guarded = region->guard_size > 0 && !region->unguarded &&
+                          __atomic_fetch_add(&g_stack_guard_count, 1, __ATOMIC_RELAXED) < COROUTINE_STACK_MAX_GUARDS;
+            if (guarded && mprotect(stack, region->slot_size - region->guard_size, PROT_READ|PROT_WRITE) != 0) {
+                if (errno != ENOMEM) {
+                    perror("mprotect");
+                    return NULL;
+                }
+                guarded = 0;
+            }
+
+            // NOTE: Out of guards, the rest of the region is opened up at once,
+            //       which extends the previous mapping instead of splitting it.
+            if (!guarded && !region->unguarded) {
+                size_t rest = (size_t)(COROUTINE_STACK_ARENA_SLOTS - slot) * region->slot_size;
+                if (mprotect(guard, rest, PROT_READ|PROT_WRITE) != 0) {
+                    perror("mprotect");
+                    return NULL;
+                }
+                region->unguarded = 1;
+            }
+            region->carved += 1;
+        } else {
+            return NULL;
+        }
+
+        // NOTE: The stack ends at the end of its slot, any rounding slack is
+        //       left between it and the guard.
+        return region->base + (size_t)(slot + 1) * region->slot_size - size;
+    }
+
+    static void coroutine__stack_region_list(CoroutineStackRegion* region) {
+        if (region->available)
+            return;
+        region->available      = 1;
+        region->next_available = g_scheduler->stack_available;
+        g_scheduler->stack_available = region;
+    }
+
+    // NOTE: Takes from the regions the scheduler knows to have free slots,
+    //       dropping the ones that turn out to be full. Only when they're all
+    //       full are the rest looked through, for slots freed by other threads
+    //       or regions left behind by a scheduler that is gone, before
+    //       another region is mapped.
+    static void* coroutine_stack_allocate(size_t size) {
+        CoroutineStackRegion* region;
+        while ((region = g_scheduler->stack_available) != NULL) {
+            void* stack = coroutine__stack_region_take(region, size);
+            if (stack != NULL)
+                return stack;
+            g_scheduler->stack_available = region->next_available;
+            region->available = 0;
+        }
+
+        int count = __atomic_load_n(&g_stack_region_count, __ATOMIC_ACQUIRE);
+        for (int i = 0; i < count; ++i) {
+            region = __atomic_load_n(&g_stack_regions[i], __ATOMIC_ACQUIRE);
+            if (region == NULL)
+                continue;
+
+            uintptr_t owner = __atomic_load_n(&region->owner, __ATOMIC_ACQUIRE);
+            if (owner == 0 && __atomic_compare_exchange_n(&region->owner, &owner, COROUTINE__STACK_OWNER, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+                owner = COROUTINE__STACK_OWNER;
+            if (owner != COROUTINE__STACK_OWNER)
+                continue;
+
+            void* stack = coroutine__stack_region_take(region, size);
+            if (stack != NULL) {
+                coroutine__stack_region_list(region);
+                return stack;
+            }
+        }
+
+        region = coroutine__stack_region_map(size);
+        if (region == NULL)
+            return NULL;
+        coroutine__stack_region_list(region);
+        return coroutine__stack_region_take(region, size);
+    }
+
+    static CoroutineStackRegion* coroutine__stack_region_of(void* ptr, size_t size) {
+        uintptr_t start = (uintptr_t)ptr & ~(uintptr_t)(coroutine__stack_region_align(size) - 1);
+        return *(CoroutineStackRegion**)start;
+    }
+
+    static void coroutine_stack_deallocate(void* ptr, size_t size) {
+        CoroutineStackRegion* region = coroutine__stack_region_of(ptr, size);
+        COROUTINE_ASSERT(region->base <= (char*)ptr && (char*)ptr < region->base + region->slot_size * COROUTINE_STACK_ARENA_SLOTS);
+        int slot = (int)(((char*)ptr - region->base) / region->slot_size);
+
+        if (__atomic_load_n(&region->owner, __ATOMIC_RELAXED) == COROUTINE__STACK_OWNER) {
+            region->next[slot] = region->first_free;
+            region->first_free = slot;
+            coroutine__stack_region_list(region);
+        } else {
+            int head = __atomic_load_n(&region->remote_free, __ATOMIC_RELAXED);
+            do {
+                region->next[slot] = head;
+            } while (!__atomic_compare_exchange_n(&region->remote_free, &head, slot, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        }
+    }
+
+    // NOTE: Called when a scheduler is destroyed. Its free slots go to the
+    //       remote list, so whoever claims the region next finds them.
+    static void coroutine__stack_release(void) {
+        int count = __atomic_load_n(&g_stack_region_count, __ATOMIC_ACQUIRE);
+        for (int i = 0; i < count; ++i) {
+            CoroutineStackRegion* region = __atomic_load_n(&g_stack_regions[i], __ATOMIC_ACQUIRE);
+            if (region == NULL || __atomic_load_n(&region->owner, __ATOMIC_RELAXED) != COROUTINE__STACK_OWNER)
+                continue;
+
+            while (region->first_free >= 0) {
+                int slot = region->first_free;
+                region->first_free = region->next[slot];
+
+                int head = __atomic_load_n(&region->remote_free, __ATOMIC_RELAXED);
+                do {
+                    region->next[slot] = head;
+                } while (!__atomic_compare_exchange_n(&region->remote_free, &head, slot, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+            }
+            region->available = 0;
+            __atomic_store_n(&region->owner, 0, __ATOMIC_RELEASE);
+        }
+        g_scheduler->stack_available = NULL;
+    }
+
+    // NOTE: Drops the pages of an idle stack. The mapping stays, so it's
+    //       committed again (zeroed) when it's next used.
+    static void coroutine__stack_reclaim(void* ptr, size_t size) {
+        size_t page  = (size_t)sysconf(_SC_PAGESIZE);
+        char*  start = (char*)(((uintptr_t)ptr + page - 1) & ~(uintptr_t)(page - 1));
+        char*  end   = (char*)ptr + size;
+        if (start < end)
+            madvise(start, (size_t)(end - start), MADV_DONTNEED);
+    }
+#elif defined(COROUTINE_STACK_MALLOC)
+    #include <stdlib.h>
+
+    #define coroutine_stack_allocate malloc
+    void coroutine_stack_deallocate(void* ptr, size_t size) {
+        free(ptr);
+    }
+#elif defined(coroutine_stack_allocate) && defined(coroutine_stack_deallocate)
+#else
+    #error "Must define an allocator/deallocator"
+#endif
+
+#if !defined(COROUTINE_STACK_MMAP)
+static void coroutine__stack_release(void) {}
+static void coroutine__stack_reclaim(void* ptr, size_t size) {}
+#endif
+
+#if !defined(COROUTINE_STACK_IDLE_KEEP)
+#define COROUTINE_STACK_IDLE_KEEP 64
+#endif
+
+// NOTE: Internal flag on free slots whose stack pages have been dropped.
+#define COROUTINE__STACK_RECLAIMED (1 << 30)
+// NOTE: Internal flag on coroutines suspended in CM_PARK.
+#define COROUTINE__PARKED          (1 << 29)
+// NOTE: Internal flag on coroutines that can run, i.e. `current` or queued in `run`.
+#define COROUTINE__RUNNABLE        (1 << 28)
+// NOTE: Internal flag on coroutines linked in a list of CoroutineEpollFd.
+#define COROUTINE__EPOLL_LINKED    (1 << 27)
+
+// NOTE: Public ids are the slot with its generation in the bits above.
+#define COROUTINE__SLOT_BITS       20
+#define COROUTINE__SLOT_MASK       ((1 << COROUTINE__SLOT_BITS) - 1)
+#define COROUTINE__GENERATION_MASK ((1u << (31 - COROUTINE__SLOT_BITS)) - 1)
+
+#if COROUTINE_MAX_COUNT > (1 << COROUTINE__SLOT_BITS)
+#error "COROUTINE_MAX_COUNT can be at most 1 << 20"
+#endif
+
+
+#if !defined(COROUTINE_LOG)
+#define COROUTINE_LOG(id, message, ...)
+#endif
+
+
+static inline Coroutine* coroutine__at(int id) {
+    return &g_scheduler->coroutines[(unsigned)id / COROUTINE_CHUNK_SIZE][(unsigned)id % COROUTINE_CHUNK_SIZE];
+}
+
+
+static int coroutine__tag(int slot) {
+    return slot | (int)(coroutine__at(slot)->generation << COROUTINE__SLOT_BITS);
+}
+
+
+// NOTE: Returns the slot of the coroutine `id`, or -1 if it has finished or
+//       was never created.
+static int coroutine__slot(int id) {
+    int slot = id & COROUTINE__SLOT_MASK;
+    if (g_scheduler->capacity == 0 || id < 0 || slot >= g_scheduler->coroutine_count)
+        return -1;
+    return coroutine__tag(slot) == id ? slot : -1;
+}
+
+
+// NOTE: The internal id of the running coroutine, i.e. its slot.
+static inline int coroutine__current_slot(void) {
+    return g_scheduler->current;
+}
+
+
+#if COROUTINE__CYCLES
+static inline uint64_t coroutine__cycles(void) {
+#if defined(__x86_64__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t ticks;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#endif
+}
+#endif
+
+
+#if defined(COROUTINE_TRACE)
+static inline void coroutine__trace(int type, int id, int fd) {
+    CoroutineTraceRing* ring = g_scheduler->trace;
+    if (ring == NULL)
+        return;
+
+    uint64_t head = ring->head;
+    ring->events[head & (COROUTINE_TRACE_SIZE - 1)] = (CoroutineTraceEvent) {
+        .stamp = (coroutine__cycles() << 8) | (unsigned)type,
+        .id    = id,
+        .fd    = fd,
+    };
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+
+static void coroutine__trace_setup(void) {
+    for (int i = 0; i < COROUTINE__SCHEDULER_SLOTS && g_scheduler->trace == NULL; ++i) {
+        CoroutineTraceRing* ring = __atomic_load_n(&g_trace_rings[i], __ATOMIC_ACQUIRE);
+        int expected = 0;
+        if (ring != NULL && __atomic_compare_exchange_n(&ring->owned, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&ring->head, 0, __ATOMIC_RELEASE);
+            g_scheduler->trace = ring;
+        } else if (ring == NULL) {
+            ring = calloc(1, sizeof(*ring));
+            if (ring == NULL)
+                return;
+            ring->owned = 1;
+
+            CoroutineTraceRing* empty = NULL;
+            if (__atomic_compare_exchange_n(&g_trace_rings[i], &empty, ring, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                g_scheduler->trace = ring;
+            else
+                free(ring);
+        }
+    }
+}
+
+
+static void coroutine__trace_destroy(void) {
+    if (g_scheduler->trace != NULL)
+        __atomic_store_n(&g_scheduler->trace->owned, 0, __ATOMIC_RELEASE);
+    g_scheduler->trace = NULL;
+}
+#else
+#define coroutine__trace(type, id, fd)
+static void coroutine__trace_setup(void) {}
+static void coroutine__trace_destroy(void) {}
+#endif
+
+
+#if COROUTINE_STATS
+static inline uint64_t coroutine__ticks(void) {
+#if !COROUTINE_STATS_TIME
+    return 0;
+#else
+    return coroutine__cycles();
+#endif
+}
+
+
+// NOTE: Accounts the time since `stats_since` to the coroutine switching out.
+static void coroutine__stats_suspend(Coroutine* coroutine, int waiting) {
+    uint64_t now = coroutine__ticks();
+    uint64_t ran = now - g_scheduler->stats_since;
+    g_scheduler->stats_since = now;
+
+    coroutine->switches  += 1;
+    coroutine->run_ticks += ran;
+    if (waiting)
+        coroutine->wait_since = now;
+    COROUTINE__COUNT(switches, 1);
+    COROUTINE__COUNT(run_ticks, ran);
+}
+
+
+static void coroutine__stats_exit(void) {
+    uint64_t now = coroutine__ticks();
+    COROUTINE__COUNT(run_ticks, now - g_scheduler->stats_since);
+    COROUTINE__COUNT(exits, 1);
+    g_scheduler->stats_since = now;
+}
+
+
+static inline void coroutine__stats_resume(Coroutine* coroutine) {
+    if (coroutine->wait_since != 0) {
+        coroutine->wait_ticks += g_scheduler->stats_since - coroutine->wait_since;
+        coroutine->wait_since  = 0;
+    }
+}
+
+
+// NOTE: Called after each check for ready fds, completions and timers.
+static void coroutine__stats_polled(int blocked) {
+    COROUTINE__COUNT(polls, 1);
+    __atomic_store_n(&g_scheduler->counters->active,   g_scheduler->active_count, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_scheduler->counters->sleeping, g_scheduler->sleep_count,  __ATOMIC_RELAXED);
+    if (blocked) {
+        uint64_t now = coroutine__ticks();
+        COROUTINE__COUNT(idle_ticks, now - g_scheduler->stats_since);
+        g_scheduler->stats_since = now;
+    }
+}
+
+
+static void coroutine__stats_setup(void) {
+    g_scheduler->counters = &g_scheduler->local_counters;
+    for (int i = 0; i < COROUTINE__SCHEDULER_SLOTS; ++i) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&g_counter_slots[i].owned, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            g_scheduler->counters = &g_counter_slots[i];
+            break;
+        }
+    }
+    *g_scheduler->counters = (CoroutineCounters) { .owned = g_scheduler->counters->owned };
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    g_scheduler->stats_since = coroutine__ticks();
+}
+
+
+static void coroutine__stats_destroy(void) {
+    if (g_scheduler->counters != NULL && g_scheduler->counters != &g_scheduler->local_counters)
+        __atomic_store_n(&g_scheduler->counters->owned, 0, __ATOMIC_RELEASE);
+    g_scheduler->counters = NULL;
+}
+#else
+static void coroutine__stats_suspend(Coroutine* coroutine, int waiting) {}
+static void coroutine__stats_exit(void) {}
+static void coroutine__stats_resume(Coroutine* coroutine) {}
+static void coroutine__stats_polled(int blocked) {}
+static void coroutine__stats_setup(void) {}
+static void coroutine__stats_destroy(void) {}
+#endif
+
+
+#if defined(COROUTINE_STACK_PROFILE)
+#define COROUTINE__STACK_PATTERN_BYTE 0xC5
+#define COROUTINE__STACK_PATTERN      0xC5C5C5C5C5C5C5C5ull
+
+static CoroutineStackProfile g_stack_profiles[COROUTINE_STACK_PROFILE_ENTRIES];
+static int                   g_stack_profile_lock;
+
+static void coroutine__lock(int* lock);
+static void coroutine__unlock(int* lock);
+
+
+// NOTE: Before the frame is set up, so everything but the frame is pattern.
+static void coroutine__stack_fill(Coroutine* coroutine, void (*entry)(void*)) {
+    coroutine->entry = entry;
+    memset(coroutine->stack_base, COROUTINE__STACK_PATTERN_BYTE, (char*)coroutine->stack_top - (char*)coroutine->stack_base);
+}
+
+
+// NOTE: Scans up from the bottom for the first word that isn't the pattern.
+//       A coroutine offered to other schedulers also leaves a copy of its
+//       slot just below its stack pointer (see coroutine__steal_offer).
+static size_t coroutine__stack_used(Coroutine* coroutine) {
+    const uint64_t* word = coroutine->stack_base;
+    const uint64_t* top  = coroutine->stack_top;
+    while (word < top && *word == COROUTINE__STACK_PATTERN)
+        word += 1;
+    return (size_t)((const char*)top - (const char*)word);
+}
+
+
+// NOTE: Called on every switch. The stack pointer says if it's past the end
+//       right now, and the pattern at the bottom if it ever was.
+static void coroutine__stack_check(int id, Coroutine* coroutine) {
+    if (coroutine->stack_base == NULL)
+        return;
+    if ((char*)coroutine->stack_ptr < (char*)coroutine->stack_base || *(uint64_t*)coroutine->stack_base != COROUTINE__STACK_PATTERN) {
+        fprintf(stderr, "coroutine %d overflowed its stack of %d bytes\n", coroutine__tag(id), (int)COROUTINE_STACK_SIZE);
+        abort();
+    }
+}
+
+
+static void coroutine__stack_record(Coroutine* coroutine) {
+    size_t used = coroutine__stack_used(coroutine);
+    int bucket = 0;
+    while (bucket < COROUTINE_STACK_PROFILE_BUCKETS - 1 && used > ((size_t)256 << bucket))
+        bucket += 1;
+
+    // NOTE: Open addressing on the entry function. Once it's full, new entry
+    //       functions aren't recorded.
+    size_t start = ((uintptr_t)coroutine->entry >> 4) % COROUTINE_STACK_PROFILE_ENTRIES;
+    coroutine__lock(&g_stack_profile_lock);
+    for (size_t i = 0; i < COROUTINE_STACK_PROFILE_ENTRIES; ++i) {
+        CoroutineStackProfile* profile = &g_stack_profiles[(start + i) % COROUTINE_STACK_PROFILE_ENTRIES];
+        if (profile->entry == NULL)
+            profile->entry = coroutine->entry;
+        if (profile->entry != coroutine->entry)
+            continue;
+
+        profile->count += 1;
+        profile->buckets[bucket] += 1;
+        if (used > profile->max)
+            profile->max = used;
+        break;
+    }
+    coroutine__unlock(&g_stack_profile_lock);
+}
+#else
+static inline void coroutine__stack_fill(Coroutine* coroutine, void (*entry)(void*)) {}
+static void coroutine__stack_check(int id, Coroutine* coroutine) {}
+static void coroutine__stack_record(Coroutine* coroutine) {}
+#endif
+
+
+// NOTE: Makes room for coroutine `id`, which is at most one past the last.
+//       Returns 0 if it's above COROUTINE_MAX_COUNT or we're out of memory.
+static int coroutine__reserve(int id) {
+    if (id >= COROUTINE_MAX_COUNT)
+        return 0;
+
+    if (id >= g_scheduler->capacity) {
+        int capacity = g_scheduler->capacity ? g_scheduler->capacity * 2 : COROUTINE__INITIAL_CAPACITY;
+        if (capacity > COROUTINE_MAX_COUNT)
+            capacity = COROUTINE_MAX_COUNT;
+
+        // NOTE: A table that grew stays bigger if a later one fails, which
+        //       is harmless as long as `capacity` and the run rings are left
+        //       as they were until all of them have grown.
+        struct pollfd* polls = realloc(g_scheduler->polls, (capacity + 2) * sizeof(*polls));
+        if (polls == NULL) return 0;
+        g_scheduler->polls = polls;
+
+        int* sleeping = realloc(g_scheduler->sleeping, capacity * sizeof(*sleeping));
+        if (sleeping == NULL) return 0;
+        g_scheduler->sleeping = sleeping;
+
+        int* timers = realloc(g_scheduler->timers, capacity * sizeof(*timers));
+        if (timers == NULL) return 0;
+        g_scheduler->timers = timers;
+
+        int* runs[COROUTINE__PRIORITY_COUNT];
+        for (int level = 0; level < COROUTINE__PRIORITY_COUNT; ++level) {
+            runs[level] = realloc(g_scheduler->run[level], 2 * capacity * sizeof(*runs[level]));
+            if (runs[level] == NULL) return 0;
+            g_scheduler->run[level] = runs[level];
+        }
+
+        // NOTE: If a ring wraps around, the part from its head moves to the
+        //       end of the new space so it stays contiguous with the rest.
+        int old_size = 2 * g_scheduler->capacity;
+        int shift    = 2 * capacity - old_size;
+        for (int level = 0; level < COROUTINE__PRIORITY_COUNT; ++level) {
+            int* run  = runs[level];
+            int  head = g_scheduler->run_head[level];
+            if (head + g_scheduler->run_count[level] > old_size) {
+                memmove(run + head + shift, run + head, (old_size - head) * sizeof(*run));
+                for (int i = head + shift; i < old_size + shift; ++i) {
+                    if (run[i] >= 0)
+                        coroutine__at(run[i])->run_index = i;
+                }
+                g_scheduler->run_head[level] = head + shift;
+            }
+        }
+
+        g_scheduler->capacity = capacity;
+    }
+
+    Coroutine** chunk = &g_scheduler->coroutines[(unsigned)id / COROUTINE_CHUNK_SIZE];
+    if (*chunk == NULL)
+        *chunk = calloc(COROUTINE_CHUNK_SIZE, sizeof(Coroutine));
+    return *chunk != NULL;
+}
+
+
+static int coroutine__is_active(int id) {
+    return (coroutine__at(id)->flags & COROUTINE__RUNNABLE) != 0;
+}
+
+
+// NOTE: The back-indices are only trusted if the entry they point at is the
+//       coroutine itself, so stale indices (e.g. of a reused slot) are harmless.
+static int coroutine__is_sleeping(int id) {
+    int index = coroutine__at(id)->sleep_index;
+    return index < g_scheduler->sleep_count && g_scheduler->sleeping[index] == id;
+}
+
+
+static int coroutine__level(int id) {
+    int flags = coroutine__at(id)->flags;
+    return (flags & CF_PRIORITY_HIGH) ? 0 : (flags & CF_PRIORITY_LOW) ? 2 : 1;
+}
+
+
+static int coroutine__run_index(int level, int position) {
+    int index = g_scheduler->run_head[level] + position;
+    return index < 2 * g_scheduler->capacity ? index : index - 2 * g_scheduler->capacity;
+}
+
+
+static int* coroutine__run_entry(int level, int position) {
+    return &g_scheduler->run[level][coroutine__run_index(level, position)];
+}
+
+
+// NOTE: Moves the coroutines of a full ring up over the holes between them.
+static void coroutine__run_pack(int level) {
+    int count = 0;
+    for (int i = 0; i < g_scheduler->run_count[level]; ++i) {
+        int id = *coroutine__run_entry(level, i);
+        if (id < 0)
+            continue;
+        int index = coroutine__run_index(level, count++);
+        g_scheduler->run[level][index] = id;
+        coroutine__at(id)->run_index   = index;
+    }
+    g_scheduler->run_count[level] = count;
+    g_scheduler->run_holes[level] = 0;
+}
+
+
+// NOTE: Queues a runnable coroutine (e.g. `current` when it yields) at the
+//       back of its level.
+static void coroutine__run_push(int id) {
+    int level = coroutine__level(id);
+    if (g_scheduler->run_count[level] == 2 * g_scheduler->capacity)
+        coroutine__run_pack(level);
+
+    int index = coroutine__run_index(level, g_scheduler->run_count[level]);
+    g_scheduler->run[level][index] = id;
+    coroutine__at(id)->run_index   = index;
+    g_scheduler->run_count[level] += 1;
+}
+
+
+// NOTE: Takes the coroutine to run next from the front of the highest level
+//       that has one, unless a lower level is due (see COROUTINE_PRIORITY_AGING).
+//       Something must be runnable.
+static int coroutine__run_pop(void) {
+    int chosen = -1;
+    for (int level = 0; level < COROUTINE__PRIORITY_COUNT; ++level) {
+        if (g_scheduler->run_count[level] == g_scheduler->run_holes[level])
+            continue;
+        if (chosen < 0) {
+            chosen = level;
+        } else if (++g_scheduler->run_skipped[level] >= COROUTINE_PRIORITY_AGING) {
+            chosen = level;
+            break;
+        }
+    }
+    COROUTINE_ASSERT(chosen >= 0);
+    g_scheduler->run_skipped[chosen] = 0;
+
+    int id;
+    do {
+        id = *coroutine__run_entry(chosen, 0);
+        g_scheduler->run_holes[chosen] -= (id < 0);
+        g_scheduler->run_count[chosen] -= 1;
+        g_scheduler->run_head[chosen]   = coroutine__run_index(chosen, 1);
+    } while (id < 0);
+    return id;
+}
+
+
+// NOTE: Takes a queued coroutine out of its ring, e.g. to be given away or
+//       handed off to.
+static void coroutine__run_remove(int id) {
+    int level = coroutine__level(id);
+    int index = coroutine__at(id)->run_index;
+    COROUTINE_ASSERT(g_scheduler->run[level][index] == id);
+    g_scheduler->run[level][index] = -1;
+    g_scheduler->run_holes[level] += 1;
+}
+
+
+// NOTE: The coroutine to resume when `current` switches out.
+static int coroutine__run_next(void) {
+    int id = g_scheduler->handoff;
+    if (id < 0)
+        return coroutine__run_pop();
+    g_scheduler->handoff = -1;
+    return id;
+}
+
+
+// NOTE: Counts the coroutine as runnable, but leaves queueing it to the caller.
+static void coroutine__make_runnable(int id) {
+    coroutine__at(id)->flags |= COROUTINE__RUNNABLE;
+    g_scheduler->active_count += 1;
+    COROUTINE__PEAK(peak_active, g_scheduler->active_count);
+    coroutine__trace(CT_READY, coroutine__tag(id), -1);
+}
+
+
+static void coroutine__activate(int id) {
+    coroutine__make_runnable(id);
+    coroutine__run_push(id);
+}
+
+
+// NOTE: For `current` when it stops being runnable; it's not in `run`.
+static void coroutine__deactivate(int id) {
+    COROUTINE_ASSERT(g_scheduler->active_count > 0);
+    coroutine__at(id)->flags &= ~COROUTINE__RUNNABLE;
+    g_scheduler->active_count -= 1;
+}
+
+
+static void coroutine__init(void) {
+#if COROUTINE_IS_THREADED
+    if (g_current_scheduler == NULL)
+        g_current_scheduler = &g_default_scheduler;
+#endif
+    if (g_scheduler->capacity == 0) {
+        if (!coroutine__reserve(0)) {
+            perror("coroutine__init");
+            COROUTINE_ASSERT(0 && "Couldn't allocate the coroutine tables");
+        }
+        // NOTE: Coroutine 0 is the thread itself and is running at first.
+        coroutine__at(0)->flags |= COROUTINE__RUNNABLE;
+        coroutine__stats_setup();
+        coroutine__trace_setup();
+        COROUTINE__PEAK(peak_active, 1);
+    }
+}
+
+
+static inline int safety_check(void) {
+    // NOTE: While `current` switches out after yielding it's already queued.
+    int queued = 0;
+    int current_queued = 0;
+    for (int level = 0; level < COROUTINE__PRIORITY_COUNT; level++) {
+        int holes = 0;
+        for (int i = 0; i < g_scheduler->run_count[level]; i++) {
+            int id = *coroutine__run_entry(level, i);
+            if (id < 0) {
+                holes += 1;
+                continue;
+            }
+            COROUTINE_ASSERT(coroutine__level(id) == level);
+            COROUTINE_ASSERT(coroutine__at(id)->run_index == coroutine__run_index(level, i));
+            current_queued |= (id == g_scheduler->current);
+            COROUTINE_ASSERT(coroutine__at(id)->flags & COROUTINE__RUNNABLE);
+            COROUTINE_ASSERT(id == 0 || coroutine__at(id)->stack_base != NULL);
+            for (int j = i + 1; j < g_scheduler->run_count[level]; j++) {
+                COROUTINE_ASSERT(id != *coroutine__run_entry(level, j));
+            }
+        }
+        COROUTINE_ASSERT(holes == g_scheduler->run_holes[level]);
+        queued += g_scheduler->run_count[level] - holes;
+    }
+    COROUTINE_ASSERT(g_scheduler->active_count == queued + (coroutine__is_active(g_scheduler->current) && !current_queued) + (g_scheduler->handoff >= 0));
+
+    for (int i = 0; i < g_scheduler->sleep_count - 1; i++) {
+        for (int j = i + 1; j < g_scheduler->sleep_count; j++) {
+            COROUTINE_ASSERT(g_scheduler->sleeping[i] != g_scheduler->sleeping[j]);
+        }
+    }
+
+    // NOTE: Free slots might have given their stack away to another scheduler,
+    //       but everything that can run or is waiting has one.
+    COROUTINE_ASSERT(coroutine__at(0)->stack_base == NULL);
+    for (int i = 0; i < g_scheduler->sleep_count; i++) {
+        COROUTINE_ASSERT(g_scheduler->sleeping[i] == 0 || coroutine__at(g_scheduler->sleeping[i])->stack_base != NULL);
+        COROUTINE_ASSERT(coroutine__at(g_scheduler->sleeping[i])->sleep_index == i);
+    }
+
+    return 1;
+}
+
+
+static int coroutine__steal_setup(void);
+#if defined(COROUTINE_SHARED_STACK)
+static int coroutine__shared_setup(void);
+#endif
+static void coroutine__return_from_current_coroutine(void);
+int coroutine_create(void (*f)(void*), const void* data, size_t size, void (*on_destroy)(void*, size_t))
+{
+    return coroutine_create_ex(f, data, size, on_destroy, CF_NONE);
+}
+
+
+// NOTE: Lays out a new coroutine's stack below `stack_top` so that restoring
+//       it calls `f` with a copy of `data` and returns into
+//       `coroutine__return_from_current_coroutine`. The frame is written at
+//       `stack_top` but will run at `run_top`, which only differs when it's
+//       built in a buffer to be copied onto the shared stack.
+static char* coroutine__setup_frame(char* stack_top, char* run_top, void (*f)(void*), const void* data, size_t size)
+{
+    char* ptr_top = stack_top - size;
+    memcpy(ptr_top, data, size);
+
+    void*  arg = run_top - size;
+    void** ptr = (void*) ptr_top;
+
+    #if defined(__x86_64__)
+        *(--ptr) = (void*) coroutine__return_from_current_coroutine;
+        *(--ptr) = (void*) f;
+        *(--ptr) = arg;                     // push rdi
+        *(--ptr) = 0;                       // push rbp
+        *(--ptr) = 0;                       // push rbx
+        *(--ptr) = 0;                       // push r12
+        *(--ptr) = 0;                       // push r13
+        *(--ptr) = 0;                       // push r14
+        *(--ptr) = 0;                       // push r15
+    #if defined(COROUTINE_SWITCH_FP_STATE)
+        *(--ptr) = (void*) 0x0000037F00001F80; // x87 control word and MXCSR defaults
+    #endif
+    #elif defined(__aarch64__)
+        *(--ptr) = arg;                     // push x0
+        *(--ptr) = (void*) coroutine__return_from_current_coroutine;
+        *(--ptr) = (void*) f;               // push x30
+        *(--ptr) = 0;                       // push x29
+        *(--ptr) = 0;                       // push x28
+        *(--ptr) = 0;                       // push x27
+        *(--ptr) = 0;                       // push x26
+        *(--ptr) = 0;                       // push x25
+        *(--ptr) = 0;                       // push x24
+        *(--ptr) = 0;                       // push x23
+        *(--ptr) = 0;                       // push x22
+        *(--ptr) = 0;                       // push x21
+        *(--ptr) = 0;                       // push x20
+        *(--ptr) = 0;                       // push x19
+    #if !defined(COROUTINE_SWITCH_INTEGER_ONLY)
+        for (int i = 15; i >= 8; --i)
+            *(--ptr) = 0;                   // push d15 to d8
+    #endif
+    #if defined(COROUTINE_SWITCH_FP_STATE)
+        *(--ptr) = 0;                       // padding
+        *(--ptr) = 0;                       // push fpcr
+    #endif
+    #else
+    #error "Unsupported platform! Only supports x86_64 or Aarch64."
+    #endif
+
+    return (char*) ptr;
+}
+
+
+#if defined(__x86_64__) && defined(COROUTINE_SWITCH_FP_STATE)
+#define COROUTINE__FRAME_SIZE (10 * sizeof(void*))
+#elif defined(__x86_64__)
+#define COROUTINE__FRAME_SIZE (9 * sizeof(void*))
+#elif defined(__aarch64__) && defined(COROUTINE_SWITCH_INTEGER_ONLY)
+#define COROUTINE__FRAME_SIZE (14 * sizeof(void*))
+#elif defined(__aarch64__) && defined(COROUTINE_SWITCH_FP_STATE)
+#define COROUTINE__FRAME_SIZE (24 * sizeof(void*))
+#elif defined(__aarch64__)
+#define COROUTINE__FRAME_SIZE (22 * sizeof(void*))
+#endif
+
+
+int coroutine_create_ex(void (*f)(void*), const void* data, size_t size, void (*on_destroy)(void*, size_t), int flags)
+{
+    coroutine__init();
+    COROUTINE_ASSERT(safety_check());
+
+    if ((flags & CF_STEALABLE) && !coroutine__steal_setup())
+        flags &= ~CF_STEALABLE;
+
+    // NOTE: Rounding up size to a multiple of 16 as the stack is required to
+    //       be 16-byte aligned on certain architectures.
+    size_t arg_size = size;
+    size = (size + 15) & ~(size_t)15;
+
+#if defined(COROUTINE_SHARED_STACK)
+    // NOTE: The new coroutine starts out saved, as it doesn't own the stack.
+    size_t saved_size = size + COROUTINE__FRAME_SIZE;
+    void*  saved = malloc(saved_size);
+    if (saved == NULL || !coroutine__shared_setup()) {
+        free(saved);
+        return -1;
+    }
+#endif
+
+    int id = g_scheduler->first_free;
+    if (id != 0) {
+        Coroutine* free = coroutine__at(id);
+
+#if !defined(COROUTINE_SHARED_STACK)
+        // NOTE: The slot's stack went to another scheduler with its coroutine.
+        if (free->stack_base == NULL) {
+            void* stack = coroutine_stack_allocate(COROUTINE_STACK_SIZE);
+            if (stack == NULL)
+                return -1;
+            free->stack_base = stack;
+            free->stack_top  = (char*)stack + COROUTINE_STACK_SIZE;
+        } else if (!(free->flags & COROUTINE__STACK_RECLAIMED)) {
+            g_scheduler->idle_stacks -= 1;
+        }
+#endif
+
+        g_scheduler->first_free = free->next_free;
+    } else {
+        if (!coroutine__reserve(g_scheduler->coroutine_count))
+            goto error;
+
+#if defined(COROUTINE_SHARED_STACK)
+        void* stack = g_scheduler->shared_stack;
+#else
+        void* stack = coroutine_stack_allocate(COROUTINE_STACK_SIZE);
+        if (stack == NULL)
+            return -1;
+#endif
+        // TODO: Assert is 16 byte aligned.
+
+        id = g_scheduler->coroutine_count++;
+        *coroutine__at(id) = (Coroutine) {
+            .stack_base = stack,
+            .stack_top = (char*)stack + COROUTINE_STACK_SIZE,
+        };
+    }
+
+    Coroutine* coroutine = coroutine__at(id);
+    coroutine->destroy  = on_destroy;
+    coroutine->arg_size = arg_size;
+    coroutine->flags    = flags;
+#if COROUTINE_STATS
+    coroutine->switches   = 0;
+    coroutine->run_ticks  = 0;
+    coroutine->wait_ticks = 0;
+    coroutine->wait_since = 0;
+#endif
+    COROUTINE__COUNT(creates, 1);
+    coroutine__trace(CT_CREATE, coroutine__tag(id), -1);
+
+#if defined(COROUTINE_SHARED_STACK)
+    coroutine__setup_frame((char*)saved + saved_size, coroutine->stack_top, f, data, size);
+    coroutine->saved          = saved;
+    coroutine->saved_capacity = saved_size;
+    coroutine->stack_ptr      = (char*)coroutine->stack_top - saved_size;
+#else
+    coroutine__stack_fill(coroutine, f);
+    coroutine->stack_ptr = coroutine__setup_frame(coroutine->stack_top, coroutine->stack_top, f, data, size);
+#endif
+
+    coroutine__activate(id);
+
+    COROUTINE_ASSERT(safety_check());
+    return coroutine__tag(id);
+
+error:
+#if defined(COROUTINE_SHARED_STACK)
+    free(saved);
+#endif
+    return -1;
+}
+
+static void coroutine__ring_destroy(void);
+static void coroutine__steal_destroy(void);
+static void coroutine__inbox_destroy(void);
+static void coroutine__shared_destroy(void);
+void coroutine_destroy_all(void) {
+    coroutine__init();
+    COROUTINE_ASSERT(safety_check());
+    COROUTINE_ASSERT(coroutine_id() == 0);
+
+    // NOTE: Closing the ring cancels the outstanding reads and writes, which
+    //       must happen before the stacks they point into are freed.
+    coroutine__ring_destroy();
+    coroutine__steal_destroy();
+    coroutine__inbox_destroy();
+
+    for (int i = 1; i < g_scheduler->coroutine_count; i++) {
+        Coroutine* coroutine = coroutine__at(i);
+#if defined(COROUTINE_SHARED_STACK)
+        COROUTINE_LOG(0, "Destroying coroutine %d saved at %p", i, coroutine->saved);
+        free(coroutine->saved);
+#else
+        if (coroutine->stack_base == NULL)
+            continue;
+        coroutine_stack_deallocate(coroutine->stack_base, (char*)coroutine->stack_top - (char*)coroutine->stack_base);
+        COROUTINE_LOG(0, "Destroying coroutine %d at %p", i, coroutine->stack_base);
+#endif
+    }
+    coroutine__shared_destroy();
+    coroutine__stats_destroy();
+    coroutine__trace_destroy();
+
+    g_scheduler->sleep_count     = 0;
+    g_scheduler->timer_count     = 0;
+    g_scheduler->active_count    = 1;
+    g_scheduler->coroutine_count = 1;
+    g_scheduler->current         = 0;
+    g_scheduler->handoff         = -1;
+    g_scheduler->poll_interval   = 1;
+    g_scheduler->poll_countdown  = 1;
+    g_scheduler->first_free      = 0;
+    g_scheduler->idle_stacks     = 0;
+    g_scheduler->park_count      = 0;
+    coroutine__stack_release();
+
+    for (int i = 0; i < COROUTINE__CHUNK_COUNT && g_scheduler->coroutines[i] != NULL; i++) {
+        free(g_scheduler->coroutines[i]);
+        g_scheduler->coroutines[i] = NULL;
+    }
+    free(g_scheduler->polls);
+    free(g_scheduler->sleeping);
+    for (int level = 0; level < COROUTINE__PRIORITY_COUNT; ++level) {
+        free(g_scheduler->run[level]);
+        g_scheduler->run[level]         = NULL;
+        g_scheduler->run_head[level]    = 0;
+        g_scheduler->run_count[level]   = 0;
+        g_scheduler->run_holes[level]   = 0;
+        g_scheduler->run_skipped[level] = 0;
+    }
+    free(g_scheduler->timers);
+    g_scheduler->polls    = NULL;
+    g_scheduler->sleeping = NULL;
+    g_scheduler->timers   = NULL;
+    g_scheduler->capacity = 0;
+
+#if defined(COROUTINE_POLL_EPOLL)
+    if (g_scheduler->epoll_fd >= 0) {
+        close(g_scheduler->epoll_fd);
+        g_scheduler->epoll_fd = -1;
+    }
+    free(g_scheduler->epoll_waiters);
+    g_scheduler->epoll_waiters = NULL;
+    g_scheduler->epoll_waiter_capacity = 0;
+#if defined(COROUTINE_WORK_STEALING)
+    g_scheduler->steal_epoll = 0;
+#endif
+#endif
+}
+
+
+#if defined(__x86_64__)
+// rdi, rsi, rdx, rcx, r8, and r9 are arguments
+// r12, r13, r14, r15, rbx, rsp, rbp are the callee-saved registers
+// NOTE: The return address and 7 pushes leave rsp 16-byte aligned, so it's
+//       padded by 8 to look like a call into `coroutine__switch_context`.
+//       With COROUTINE_SWITCH_FP_STATE the control state takes that slot.
+#if defined(COROUTINE_SWITCH_FP_STATE)
+#define COROUTINE__STORE_FP                         \
+    "    subq $8, %rsp\n"                           \
+    "    stmxcsr (%rsp)\n"                          \
+    "    fnstcw 4(%rsp)\n"
+#define COROUTINE__RESTORE_FP                       \
+    "    ldmxcsr (%rsp)\n"                          \
+    "    fldcw 4(%rsp)\n"                           \
+    "    addq $8, %rsp\n"
+#define COROUTINE__ALIGN ""
+#else
+#define COROUTINE__STORE_FP   ""
+#define COROUTINE__RESTORE_FP ""
+#define COROUTINE__ALIGN      "    subq $8, %rsp\n"
+#endif
+#define STORE_REGISTERS                             \
+    "    pushq %rdi\n"                              \
+    "    pushq %rbp\n"                              \
+    "    pushq %rbx\n"                              \
+    "    pushq %r12\n"                              \
+    "    pushq %r13\n"                              \
+    "    pushq %r14\n"                              \
+    "    pushq %r15\n"                              \
+    COROUTINE__STORE_FP                             \
+    "    movq %rsp, %rdx\n"                         \
+    COROUTINE__ALIGN                                \
+    "    jmp coroutine__switch_context\n"
+#define RESTORE_REGISTERS                           \
+    "    movq %rdi, %rsp\n"                         \
+    COROUTINE__RESTORE_FP                           \
+    "    popq %r15\n"                               \
+    "    popq %r14\n"                               \
+    "    popq %r13\n"                               \
+    "    popq %r12\n"                               \
+    "    popq %rbx\n"                               \
+    "    popq %rbp\n"                               \
+    "    popq %rdi\n"                               \
+    "    ret\n"
+#elif defined(__aarch64__)
+// x19 to x28 are callee-saved, and so is the lower half (d8 to d15) of v8 to v15
+// x0 to x7 are arguments/return values
+// NOTE: x30 is pushed twice: the pair with x29 is where we resume and the
+//       other one is the link register we resume with. They only differ in
+//       a new coroutine's frame, which resumes at its entry function.
+#if defined(COROUTINE_SWITCH_INTEGER_ONLY)
+#define COROUTINE__STORE_FP   ""
+#define COROUTINE__RESTORE_FP ""
+#else
+#define COROUTINE__STORE_FP                                                     \
+    "stp d14, d15, [sp, #-16]!\n"                                               \
+    "stp d12, d13, [sp, #-16]!\n"                                               \
+    "stp d10, d11, [sp, #-16]!\n"                                               \
+    "stp d8,   d9, [sp, #-16]!\n"
+#define COROUTINE__RESTORE_FP                                                   \
+    "ldp d8,   d9, [sp], #16\n"                                                 \
+    "ldp d10, d11, [sp], #16\n"                                                 \
+    "ldp d12, d13, [sp], #16\n"                                                 \
+    "ldp d14, d15, [sp], #16\n"
+#endif
+#if defined(COROUTINE_SWITCH_FP_STATE)
+#define COROUTINE__STORE_FP_STATE                                               \
+    "mrs x9, fpcr\n"                                                            \
+    "stp x9,  xzr, [sp, #-16]!\n"
+#define COROUTINE__RESTORE_FP_STATE                                             \
+    "ldr x9, [sp], #16\n"                                                       \
+    "msr fpcr, x9\n"
+#else
+#define COROUTINE__STORE_FP_STATE   ""
+#define COROUTINE__RESTORE_FP_STATE ""
+#endif
+#define STORE_REGISTERS                                                         \
+    "stp x30,  x0, [sp, #-16]!\n"                                               \
+    "stp x29, x30, [sp, #-16]!\n"                                               \
+    "stp x27, x28, [sp, #-16]!\n"                                               \
+    "stp x25, x26, [sp, #-16]!\n"                                               \
+    "stp x23, x24, [sp, #-16]!\n"                                               \
+    "stp x21, x22, [sp, #-16]!\n"                                               \
+    "stp x19, x20, [sp, #-16]!\n"                                               \
+    COROUTINE__STORE_FP                                                         \
+    COROUTINE__STORE_FP_STATE                                                   \
+    "mov x2, sp\n"                                                              \
+    "b coroutine__switch_context\n"
+#define RESTORE_REGISTERS                                                       \
+    "mov sp, x0\n"                                                              \
+    COROUTINE__RESTORE_FP_STATE                                                 \
+    COROUTINE__RESTORE_FP                                                       \
+    "ldp x19, x20, [sp], #16\n"                                                 \
+    "ldp x21, x22, [sp], #16\n"                                                 \
+    "ldp x23, x24, [sp], #16\n"                                                 \
+    "ldp x25, x26, [sp], #16\n"                                                 \
+    "ldp x27, x28, [sp], #16\n"                                                 \
+    "ldp x29,  x1, [sp], #16\n"                                                 \
+    "ldp x30,  x0, [sp], #16\n"                                                 \
+    "ret x1\n"
+#else
+#error "Unsupported platform! Only supports x86_64 or Aarch64."
+#endif
+
+
+__attribute__((naked))
+void coroutine_switch(__attribute__((unused)) int fd, __attribute__((unused)) CoroutineMode mode)
+{
+    // @arch - Push the `arg` on the stack and then all callee-saved registers. Then jump to `coroutine__switch_context`.
+    __asm__ volatile (STORE_REGISTERS);
+}
+
+__attribute__((naked))
+static void coroutine__restore_context(__attribute__((unused)) void *rsp)
+{
+    // @arch - Set the stack to `rsp`, restore all callee-saved registers and set the parameter in `rdi`.
+    __asm__ volatile (RESTORE_REGISTERS);
+}
+
+
+#if defined(COROUTINE_SHARED_STACK)
+#if defined(__x86_64__)
+// NOTE: The pushed 0 takes the place of a return address, so `f` sees the
+//       stack aligned as if it was called.
+#define CALL_ON_STACK                               \
+    "    movq %rdx, %rsp\n"                         \
+    "    pushq $0\n"                                \
+    "    jmp *%rsi\n"
+#elif defined(__aarch64__)
+#define CALL_ON_STACK                                                           \
+    "mov sp, x2\n"                                                              \
+    "mov x30, xzr\n"                                                            \
+    "br x1\n"
+#endif
+
+__attribute__((naked))
+static void coroutine__call_on_stack(__attribute__((unused)) void* arg, __attribute__((unused)) void (*f)(void*), __attribute__((unused)) void* stack_top)
+{
+    // @arch - Set the stack to `stack_top` and jump to `f` with `arg`. `f` must never return.
+    __asm__ volatile (CALL_ON_STACK);
+}
+
+
+static int coroutine__shared_setup(void) {
+    if (g_scheduler->shared_stack == NULL)
+        g_scheduler->shared_stack = coroutine_stack_allocate(COROUTINE_STACK_SIZE);
+    if (g_scheduler->shared_scratch == NULL)
+        g_scheduler->shared_scratch = coroutine_stack_allocate(COROUTINE_STACK_SIZE);
+    return g_scheduler->shared_stack != NULL && g_scheduler->shared_scratch != NULL;
+}
+
+
+static void coroutine__shared_destroy(void) {
+    if (g_scheduler->shared_stack != NULL)
+        coroutine_stack_deallocate(g_scheduler->shared_stack, COROUTINE_STACK_SIZE);
+    if (g_scheduler->shared_scratch != NULL)
+        coroutine_stack_deallocate(g_scheduler->shared_scratch, COROUTINE_STACK_SIZE);
+    g_scheduler->shared_stack   = NULL;
+    g_scheduler->shared_scratch = NULL;
+    g_scheduler->shared_owner   = 0;
+}
+
+
+// NOTE: Copies the live part of the owner's stack out so another coroutine
+//       can run on it. The buffer is kept, so it only grows with the deepest
+//       point the coroutine has been suspended at.
+static void coroutine__shared_save(void) {
+    Coroutine* owner = coroutine__at(g_scheduler->shared_owner);
+    size_t size = (char*)owner->stack_top - (char*)owner->stack_ptr;
+    if (size > owner->saved_capacity) {
+        size_t capacity = (size + 255) & ~(size_t)255;
+        void*  saved = realloc(owner->saved, capacity);
+        if (saved == NULL) {
+            perror("coroutine__shared_save");
+            COROUTINE_ASSERT(0 && "Couldn't allocate a buffer for the stack");
+        }
+        owner->saved          = saved;
+        owner->saved_capacity = capacity;
+    }
+
+    memcpy(owner->saved, owner->stack_ptr, size);
+    g_scheduler->shared_owner = 0;
+}
+
+
+static void coroutine__shared_load(void* arg) {
+    int id = (int)(intptr_t)arg;
+    Coroutine* coroutine = coroutine__at(id);
+    memcpy(coroutine->stack_ptr, coroutine->saved, (char*)coroutine->stack_top - (char*)coroutine->stack_ptr);
+    g_scheduler->shared_owner = id;
+    coroutine__restore_context(coroutine->stack_ptr);
+}
+
+
+// NOTE: The owner stays on the shared stack until another coroutine needs it,
+//       so switching back and forth with the thread's own coroutine doesn't
+//       copy anything. If we're on the shared stack, the next one's frames
+//       could overwrite ours, so they're copied in from the scratch stack.
+static void coroutine__resume(int id) {
+    Coroutine* coroutine = coroutine__at(id);
+    if (coroutine->stack_base == NULL || id == g_scheduler->shared_owner) {
+        coroutine__restore_context(coroutine->stack_ptr);
+        return;
+    }
+
+    if (g_scheduler->shared_owner != 0)
+        coroutine__shared_save();
+
+    char here;
+    if (g_scheduler->shared_stack <= &here && &here < g_scheduler->shared_stack + COROUTINE_STACK_SIZE)
+        coroutine__call_on_stack((void*)(intptr_t)id, coroutine__shared_load, g_scheduler->shared_scratch + COROUTINE_STACK_SIZE);
+    else
+        coroutine__shared_load((void*)(intptr_t)id);
+}
+#else
+static void coroutine__shared_destroy(void) {}
+
+static void coroutine__resume(int id) {
+    coroutine__restore_context(coroutine__at(id)->stack_ptr);
+}
+#endif
+
+
+static uint64_t coroutine__now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+
+#if COROUTINE__CYCLES
+// NOTE: Nanoseconds per cycle counter tick, in 32.32 fixed point. The rate
+//       isn't exposed on x86_64, so it's measured against the clock (over
+//       10 ms) the first time it's needed.
+static uint64_t coroutine__cycle_scale(void) {
+#if defined(__aarch64__)
+    uint64_t frequency;
+    __asm__ volatile("mrs %0, cntfrq_el0" : "=r"(frequency));
+    return (1000000000ull << 32) / frequency;
+#else
+    uint64_t scale = __atomic_load_n(&g_ns_per_tick, __ATOMIC_RELAXED);
+    if (scale == 0) {
+        uint64_t start_ns = coroutine__now();
+        uint64_t start    = coroutine__cycles();
+        struct timespec pause = { .tv_sec = 0, .tv_nsec = 10000000 };
+        while (nanosleep(&pause, &pause) != 0 && errno == EINTR) {}
+        uint64_t elapsed = coroutine__cycles() - start;
+        scale = (uint64_t)(((unsigned __int128)(coroutine__now() - start_ns) << 32) / (elapsed ? elapsed : 1));
+        __atomic_store_n(&g_ns_per_tick, scale, __ATOMIC_RELAXED);
+    }
+    return scale;
+#endif
+}
+#endif
+
+
+static void coroutine__timer_swap(int a, int b) {
+    int id_a = g_scheduler->timers[a];
+    int id_b = g_scheduler->timers[b];
+    g_scheduler->timers[a] = id_b;
+    g_scheduler->timers[b] = id_a;
+    coroutine__at(id_b)->timer_index = a;
+    coroutine__at(id_a)->timer_index = b;
+}
+
+
+static int coroutine__timer_less(int a, int b) {
+    return coroutine__at(g_scheduler->timers[a])->deadline < coroutine__at(g_scheduler->timers[b])->deadline;
+}
+
+
+static void coroutine__timer_sift(int index) {
+    while (index > 0 && coroutine__timer_less(index, (index - 1) / 2)) {
+        coroutine__timer_swap(index, (index - 1) / 2);
+        index = (index - 1) / 2;
+    }
+
+    while (1) {
+        int smallest = index;
+        int left  = 2 * index + 1;
+        int right = 2 * index + 2;
+        if (left  < g_scheduler->timer_count && coroutine__timer_less(left,  smallest)) smallest = left;
+        if (right < g_scheduler->timer_count && coroutine__timer_less(right, smallest)) smallest = right;
+        if (smallest == index)
+            break;
+        coroutine__timer_swap(index, smallest);
+        index = smallest;
+    }
+}
+
+
+static int coroutine__timer_armed(int id) {
+    int index = coroutine__at(id)->timer_index;
+    return index < g_scheduler->timer_count && g_scheduler->timers[index] == id;
+}
+
+
+static void coroutine__timer_add(int id, uint64_t deadline) {
+    COROUTINE_ASSERT(!coroutine__timer_armed(id));
+    Coroutine* coroutine = coroutine__at(id);
+    coroutine->deadline    = deadline;
+    coroutine->timed_out   = 0;
+    coroutine->timer_index = g_scheduler->timer_count;
+    g_scheduler->timers[g_scheduler->timer_count++] = id;
+    coroutine__timer_sift(coroutine->timer_index);
+}
+
+
+static void coroutine__timer_remove(int id) {
+    if (!coroutine__timer_armed(id))
+        return;
+
+    int index = coroutine__at(id)->timer_index;
+    int last  = --g_scheduler->timer_count;
+    if (index != last) {
+        g_scheduler->timers[index] = g_scheduler->timers[last];
+        coroutine__at(g_scheduler->timers[index])->timer_index = index;
+        coroutine__timer_sift(index);
+    }
+}
+
+
+#if defined(COROUTINE_POLL_EPOLL)
+static int* coroutine__epoll_list(int fd, short events) {
+    CoroutineEpollFd* waiters = &g_scheduler->epoll_waiters[fd];
+    return (events & POLLIN) ? &waiters->readers : &waiters->writers;
+}
+
+
+static void coroutine__epoll_unlink(int id, int fd, short events) {
+    Coroutine* coroutine = coroutine__at(id);
+    if (!(coroutine->flags & COROUTINE__EPOLL_LINKED))
+        return;
+
+    coroutine->flags &= ~COROUTINE__EPOLL_LINKED;
+    if (coroutine->epoll_prev >= 0)
+        coroutine__at(coroutine->epoll_prev)->epoll_next = coroutine->epoll_next;
+    else
+        *coroutine__epoll_list(fd, events) = coroutine->epoll_next;
+    if (coroutine->epoll_next >= 0)
+        coroutine__at(coroutine->epoll_next)->epoll_prev = coroutine->epoll_prev;
+}
+#endif
+
+
+static void coroutine__sleep_remove(int index) {
+    COROUTINE_ASSERT(0 <= index && index < g_scheduler->sleep_count);
+    coroutine__timer_remove(g_scheduler->sleeping[index]);
+#if defined(COROUTINE_POLL_EPOLL)
+    coroutine__epoll_unlink(g_scheduler->sleeping[index], g_scheduler->polls[index].fd, g_scheduler->polls[index].events);
+#endif
+
+    int last_sleep_id = --g_scheduler->sleep_count;
+    g_scheduler->polls[index]    = g_scheduler->polls[last_sleep_id];
+    g_scheduler->sleeping[index] = g_scheduler->sleeping[last_sleep_id];
+    coroutine__at(g_scheduler->sleeping[index])->sleep_index = index;
+}
+
+
+#if defined(COROUTINE_WORK_STEALING)
+static int coroutine__steal_setup(void) {
+    if (g_scheduler->steal != NULL)
+        return 1;
+
+    for (int i = 0; i < COROUTINE_STEAL_MAX_THREADS; ++i) {
+        CoroutineStealQueue* queue = &g_steal_queues[i];
+        int expected = 0;
+        if (!__atomic_compare_exchange_n(&queue->owned, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            continue;
+
+        if (!queue->has_pipe) {
+            if (pipe(queue->notify) != 0) {
+                perror("pipe");
+                __atomic_store_n(&queue->owned, 0, __ATOMIC_RELEASE);
+                return 0;
+            }
+            for (int j = 0; j < 2; ++j) {
+                fcntl(queue->notify[j], F_SETFL, fcntl(queue->notify[j], F_GETFL, 0) | O_NONBLOCK);
+                fcntl(queue->notify[j], F_SETFD, FD_CLOEXEC);
+            }
+            queue->has_pipe = 1;
+        }
+
+        int count = __atomic_load_n(&g_steal_queue_count, __ATOMIC_RELAXED);
+        while (count < i + 1 && !__atomic_compare_exchange_n(&g_steal_queue_count, &count, i + 1, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+
+        g_scheduler->steal = queue;
+        return 1;
+    }
+
+    return 0;
+}
+
+
+static int coroutine__steal_push(CoroutineStealQueue* queue, Coroutine* stolen) {
+    int64_t bottom = __atomic_load_n(&queue->bottom, __ATOMIC_RELAXED);
+    int64_t top    = __atomic_load_n(&queue->top, __ATOMIC_ACQUIRE);
+    if (bottom - top >= COROUTINE_STEAL_QUEUE_SIZE)
+        return 0;
+
+    __atomic_store_n(&queue->entries[bottom & (COROUTINE_STEAL_QUEUE_SIZE - 1)], stolen, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&queue->bottom, bottom + 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+
+// NOTE: Only called by the owner of the queue.
+static Coroutine* coroutine__steal_pop(CoroutineStealQueue* queue) {
+    int64_t bottom = __atomic_load_n(&queue->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&queue->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t top = __atomic_load_n(&queue->top, __ATOMIC_RELAXED);
+
+    if (top > bottom) {
+        __atomic_store_n(&queue->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    Coroutine* stolen = __atomic_load_n(&queue->entries[bottom & (COROUTINE_STEAL_QUEUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (top == bottom) {
+        // NOTE: It's the last entry, so we race the thieves for it.
+        if (!__atomic_compare_exchange_n(&queue->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            stolen = NULL;
+        __atomic_store_n(&queue->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return stolen;
+}
+
+
+static Coroutine* coroutine__steal_take(CoroutineStealQueue* queue) {
+    int64_t top = __atomic_load_n(&queue->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t bottom = __atomic_load_n(&queue->bottom, __ATOMIC_ACQUIRE);
+    if (top >= bottom)
+        return NULL;
+
+    Coroutine* stolen = __atomic_load_n(&queue->entries[top & (COROUTINE_STEAL_QUEUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&queue->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return NULL;
+    return stolen;
+}
+
+
+static void coroutine__steal_notify(void) {
+    // NOTE: Pairs with the fence in `coroutine__steal_work`, so an idle
+    //       scheduler either sees the pushed entry or we see its flag.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    int count = __atomic_load_n(&g_steal_queue_count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; ++i) {
+        CoroutineStealQueue* queue = &g_steal_queues[i];
+        int expected = 1;
+        if (queue == g_scheduler->steal || !__atomic_compare_exchange_n(&queue->idle, &expected, 0, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            continue;
+
+        __atomic_fetch_sub(&g_steal_idle_count, 1, __ATOMIC_RELAXED);
+        char byte = 0;
+        if (write(queue->notify[1], &byte, 1) < 0 && errno != EAGAIN)
+            perror("write");
+        return;
+    }
+}
+
+
+// NOTE: Hands one runnable coroutine to the deque if some scheduler is idle.
+//       Neither the one about to be resumed nor the one whose stack we're
+//       running on (it just switched out) can go. A busy pool never gets here.
+static void coroutine__steal_offer(void) {
+    if (g_scheduler->steal == NULL || g_scheduler->active_count < 2 || __atomic_load_n(&g_steal_idle_count, __ATOMIC_RELAXED) == 0)
+        return;
+
+    // NOTE: Starting with what would run last.
+    char here;
+    for (int level = COROUTINE__PRIORITY_COUNT - 1; level >= 0; --level) {
+        for (int i = g_scheduler->run_count[level] - 1; i >= 0; --i) {
+            int id = *coroutine__run_entry(level, i);
+            if (id < 0)
+                continue;
+            Coroutine* coroutine = coroutine__at(id);
+            if (!(coroutine->flags & CF_STEALABLE))
+                continue;
+            // NOTE: Woken up explicitly but still linked into a wait queue, which
+            //       points at this slot.
+            if (__atomic_load_n(&coroutine->wait_queue, __ATOMIC_RELAXED) != NULL || coroutine->joiners.count != 0)
+                continue;
+            if ((char*)coroutine->stack_base <= &here && &here < (char*)coroutine->stack_top)
+                continue;
+
+            // NOTE: The stack below the saved registers is unused while it's
+            //       suspended, so the copy of the coroutine is kept there.
+            Coroutine* stolen = (Coroutine*)(((uintptr_t)coroutine->stack_ptr - sizeof(Coroutine)) & ~(uintptr_t)15);
+            COROUTINE_ASSERT((char*)stolen >= (char*)coroutine->stack_base);
+            *stolen = *coroutine;
+            if (!coroutine__steal_push(g_scheduler->steal, stolen))
+                return;
+
+            COROUTINE_LOG(id, "offered to idle schedulers%s", "");
+            coroutine__run_remove(id);
+            coroutine__deactivate(id);
+
+            // NOTE: The stack belongs to whoever takes the entry now, and the
+            //       coroutine gets a new id there.
+            coroutine->stack_base = NULL;
+            coroutine->stack_top  = NULL;
+            coroutine->generation = (coroutine->generation + 1) & COROUTINE__GENERATION_MASK;
+            coroutine->next_free  = g_scheduler->first_free;
+            g_scheduler->first_free = id;
+
+            coroutine__steal_notify();
+            return;
+        }
+    }
+}
+
+
+static Coroutine* coroutine__steal_find(void) {
+    Coroutine* stolen = coroutine__steal_pop(g_scheduler->steal);
+
+    int count = __atomic_load_n(&g_steal_queue_count, __ATOMIC_ACQUIRE);
+    int self  = (int)(g_scheduler->steal - g_steal_queues);
+    for (int i = 1; stolen == NULL && i < count; ++i)
+        stolen = coroutine__steal_take(&g_steal_queues[(self + i) % count]);
+
+    return stolen;
+}
+
+
+// NOTE: Returns a slot for an adopted coroutine, or 0 if there's none. A
+//       coroutine that just returned is on the free list while we still run
+//       on its stack, so a slot whose stack holds this frame is skipped.
+static int coroutine__steal_slot(int* previous) {
+    char here;
+    *previous = 0;
+    for (int id = g_scheduler->first_free; id != 0; *previous = id, id = coroutine__at(id)->next_free) {
+        Coroutine* free = coroutine__at(id);
+        if (free->stack_base == NULL || &here < (char*)free->stack_base || (char*)free->stack_top <= &here)
+            return id;
+    }
+    return coroutine__reserve(g_scheduler->coroutine_count) ? g_scheduler->coroutine_count : 0;
+}
+
+
+static void coroutine__steal_adopt(Coroutine* stolen, int id, int previous) {
+    if (id == g_scheduler->coroutine_count) {
+        g_scheduler->coroutine_count += 1;
+    } else {
+        Coroutine* free = coroutine__at(id);
+        if (previous == 0)
+            g_scheduler->first_free = free->next_free;
+        else
+            coroutine__at(previous)->next_free = free->next_free;
+
+        if (free->stack_base != NULL) {
+            if (!(free->flags & COROUTINE__STACK_RECLAIMED))
+                g_scheduler->idle_stacks -= 1;
+            coroutine_stack_deallocate(free->stack_base, (char*)free->stack_top - (char*)free->stack_base);
+        }
+    }
+
+    unsigned generation = coroutine__at(id)->generation;
+    *coroutine__at(id) = *stolen;
+    coroutine__at(id)->generation = generation;
+    coroutine__activate(id);
+    COROUTINE_LOG(id, "was stolen by this scheduler%s", "");
+}
+
+
+// NOTE: Called when nothing can run. Either adopts a coroutine from some
+//       deque, or marks this scheduler as idle so the next offer wakes it.
+static void coroutine__steal_work(void) {
+    int previous;
+    int id = (g_scheduler->steal != NULL) ? coroutine__steal_slot(&previous) : 0;
+    if (id == 0)
+        return;
+
+    Coroutine* stolen = coroutine__steal_find();
+    if (stolen == NULL && !g_scheduler->steal_waiting) {
+        __atomic_store_n(&g_scheduler->steal->idle, 1, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&g_steal_idle_count, 1, __ATOMIC_SEQ_CST);
+        g_scheduler->steal_waiting = 1;
+
+        // NOTE: Look again, as an offer made before the flag was visible
+        //       wouldn't have woken us up.
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        stolen = coroutine__steal_find();
+    }
+
+    if (stolen != NULL)
+        coroutine__steal_adopt(stolen, id, previous);
+}
+
+
+// NOTE: Returns the fd an idle scheduler must also wait on, or -1.
+static int coroutine__steal_fd(void) {
+    return g_scheduler->steal_waiting ? g_scheduler->steal->notify[0] : -1;
+}
+
+
+static void coroutine__steal_notified(void) {
+    g_scheduler->steal_notified = 1;
+}
+
+
+// NOTE: Called after every wait for events.
+static void coroutine__steal_wake(void) {
+    if (g_scheduler->steal_waiting) {
+        int expected = 1;
+        if (__atomic_compare_exchange_n(&g_scheduler->steal->idle, &expected, 0, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            __atomic_fetch_sub(&g_steal_idle_count, 1, __ATOMIC_RELAXED);
+        g_scheduler->steal_waiting = 0;
+    }
+
+    if (g_scheduler->steal_notified) {
+        char buffer[64];
+        while (read(g_scheduler->steal->notify[0], buffer, sizeof(buffer)) > 0) {}
+        g_scheduler->steal_notified = 0;
+    }
+}
+
+
+static void coroutine__steal_destroy(void) {
+    if (g_scheduler->steal == NULL)
+        return;
+
+    coroutine__steal_wake();
+
+    // NOTE: Whatever a thief didn't get to is destroyed with this scheduler.
+    Coroutine* stolen;
+    while ((stolen = coroutine__steal_pop(g_scheduler->steal)) != NULL) {
+        void*  stack_base = stolen->stack_base;
+        size_t stack_size = (char*)stolen->stack_top - (char*)stolen->stack_base;
+        coroutine_stack_deallocate(stack_base, stack_size);
+    }
+
+    __atomic_store_n(&g_scheduler->steal->owned, 0, __ATOMIC_RELEASE);
+    g_scheduler->steal = NULL;
+}
+#else
+static int  coroutine__steal_setup(void) { return 0; }
+static void coroutine__steal_offer(void) {}
+static void coroutine__steal_work(void) {}
+static int  coroutine__steal_fd(void) { return -1; }
+static void coroutine__steal_notified(void) {}
+static void coroutine__steal_wake(void) {}
+static void coroutine__steal_destroy(void) {}
+#endif
+
+
+#if defined(__x86_64__)
+#define COROUTINE__SPIN_PAUSE() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define COROUTINE__SPIN_PAUSE() __asm__ volatile ("yield")
+#endif
+
+// NOTE: Spins this many times before giving up the core between tries, as
+//       the holder might be waiting for it (e.g. both threads on one CPU).
+#define COROUTINE__SPIN_LIMIT 64
+
+// NOTE: Only held for a handful of instructions and never across a switch,
+//       and there's nothing to lock against without threads.
+static void coroutine__lock(int* lock) {
+#if COROUTINE_IS_THREADED
+    int spins = 0;
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+            if (spins < COROUTINE__SPIN_LIMIT) {
+                spins += 1;
+                COROUTINE__SPIN_PAUSE();
+            } else {
+                sched_yield();
+            }
+        }
+    }
+#else
+    (void)lock;
+#endif
+}
+
+
+static void coroutine__unlock(int* lock) {
+#if COROUTINE_IS_THREADED
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+#else
+    (void)lock;
+#endif
+}
+
+
+// NOTE: Parked coroutines might be woken up spuriously (e.g. through a stale
+//       id in an inbox), so whoever parks must check its condition again.
+//       Returns 0 if it wasn't parked, and otherwise leaves queueing it to
+//       the caller.
+static int coroutine__unpark_unqueued(int id) {
+    Coroutine* coroutine = coroutine__at(id);
+    if (!(coroutine->flags & COROUTINE__PARKED))
+        return 0;
+
+    coroutine->flags &= ~COROUTINE__PARKED;
+    g_scheduler->park_count -= 1;
+    coroutine__timer_remove(id);
+    coroutine__make_runnable(id);
+    return 1;
+}
+
+
+static void coroutine__unpark(int id) {
+    if (coroutine__unpark_unqueued(id))
+        coroutine__run_push(id);
+}
+
+
+#if COROUTINE_IS_THREADED
+static int coroutine__inbox_setup(void) {
+    if (g_scheduler->inbox != NULL)
+        return 1;
+
+    for (int i = 0; i < COROUTINE_MAX_THREADS; ++i) {
+        CoroutineInbox* inbox = &g_inboxes[i];
+        int expected = 0;
+        if (!__atomic_compare_exchange_n(&inbox->owned, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            continue;
+
+        if (!inbox->has_fd) {
+#if defined(__linux__)
+            inbox->fd[0] = inbox->fd[1] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+            int status = inbox->fd[0] < 0 ? -1 : 0;
+#else
+            int status = pipe(inbox->fd);
+            for (int j = 0; status == 0 && j < 2; ++j) {
+                fcntl(inbox->fd[j], F_SETFL, fcntl(inbox->fd[j], F_GETFL, 0) | O_NONBLOCK);
+                fcntl(inbox->fd[j], F_SETFD, FD_CLOEXEC);
+            }
+#endif
+            if (status != 0) {
+                perror("coroutine__inbox_setup");
+                __atomic_store_n(&inbox->owned, 0, __ATOMIC_RELEASE);
+                return 0;
+            }
+            inbox->has_fd = 1;
+        }
+
+        g_scheduler->inbox = inbox;
+        return 1;
+    }
+
+    return 0;
+}
+
+
+// NOTE: Called from other threads to wake up coroutine `id` of the inbox's owner.
+static void coroutine__inbox_push(CoroutineInbox* inbox, int id) {
+    coroutine__lock(&inbox->lock);
+    if (inbox->count == inbox->capacity) {
+        int  capacity = inbox->capacity ? inbox->capacity * 2 : 64;
+        int* ids = realloc(inbox->ids, capacity * sizeof(*ids));
+        if (ids == NULL) {
+            coroutine__unlock(&inbox->lock);
+            perror("coroutine__inbox_push");
+            return;
+        }
+        inbox->ids      = ids;
+        inbox->capacity = capacity;
+    }
+    inbox->ids[inbox->count++] = id;
+    coroutine__unlock(&inbox->lock);
+
+    if (__atomic_exchange_n(&inbox->signalled, 1, __ATOMIC_ACQ_REL) == 0) {
+#if defined(__linux__)
+        uint64_t one = 1;
+        if (write(inbox->fd[1], &one, sizeof(one)) < 0 && errno != EAGAIN)
+#else
+        char byte = 0;
+        if (write(inbox->fd[1], &byte, 1) < 0 && errno != EAGAIN)
+#endif
+            perror("write");
+    }
+}
+
+
+// NOTE: Returns the fd a blocked scheduler must also wait on, or -1.
+static int coroutine__inbox_fd(void) {
+    return (g_scheduler->inbox != NULL && g_scheduler->park_count > 0) ? g_scheduler->inbox->fd[0] : -1;
+}
+
+
+// NOTE: Called on every pass of the scheduler, so it only costs a load unless
+//       another thread has woken one of ours up.
+static void coroutine__inbox_drain(void) {
+    if (g_scheduler->inbox == NULL || !__atomic_load_n(&g_scheduler->inbox->signalled, __ATOMIC_ACQUIRE))
+        return;
+
+    __atomic_store_n(&g_scheduler->inbox->signalled, 0, __ATOMIC_SEQ_CST);
+    char buffer[64];
+    while (read(g_scheduler->inbox->fd[0], buffer, sizeof(buffer)) > 0) {}
+
+    coroutine__lock(&g_scheduler->inbox->lock);
+    for (int i = 0; i < g_scheduler->inbox->count; ++i) {
+        int id = g_scheduler->inbox->ids[i];
+        if (0 <= id && id < g_scheduler->coroutine_count)
+            coroutine__unpark(id);
+    }
+    g_scheduler->inbox->count = 0;
+    coroutine__unlock(&g_scheduler->inbox->lock);
+}
+
+
+static void coroutine__inbox_destroy(void) {
+    if (g_scheduler->inbox == NULL)
+        return;
+
+    // NOTE: The ids left are of coroutines that are gone.
+    coroutine__lock(&g_scheduler->inbox->lock);
+    g_scheduler->inbox->count = 0;
+    coroutine__unlock(&g_scheduler->inbox->lock);
+
+    __atomic_store_n(&g_scheduler->inbox->signalled, 0, __ATOMIC_SEQ_CST);
+    char buffer[64];
+    while (read(g_scheduler->inbox->fd[0], buffer, sizeof(buffer)) > 0) {}
+
+    __atomic_store_n(&g_scheduler->inbox->owned, 0, __ATOMIC_RELEASE);
+    g_scheduler->inbox = NULL;
+#if defined(COROUTINE_POLL_EPOLL)
+    g_scheduler->inbox_epoll = 0;
+#endif
+}
+#else
+static int  coroutine__inbox_setup(void) { return 1; }
+static int  coroutine__inbox_fd(void) { return -1; }
+static void coroutine__inbox_drain(void) {}
+static void coroutine__inbox_destroy(void) {}
+#endif
+
+
+// NOTE: Wakes up a coroutine that was parked on a wait queue, which might be
+//       one of another scheduler's.
+static void coroutine__wake_waiter(void* inbox, int id) {
+#if COROUTINE_IS_THREADED
+    // NOTE: It's yielding until it's taken off the queue (see coroutine__wait_on).
+    if (inbox == NULL)
+        return;
+    if (inbox != g_scheduler->inbox) {
+        coroutine__inbox_push(inbox, id);
+        return;
+    }
+#else
+    // NOTE: Without threads, another scheduler isn't running, so its tables
+    //       can be changed directly.
+    if (inbox != g_scheduler) {
+        CoroutineScheduler* current = g_current_scheduler;
+        g_current_scheduler = inbox;
+        coroutine__unpark(id);
+        g_current_scheduler = current;
+        return;
+    }
+#endif
+    coroutine__unpark(id);
+}
+
+
+// NOTE: A CoroutineWaitQueue is a FIFO of parked coroutines, linked through
+//       their Coroutine so waiting never allocates. The caller holds the lock
+//       of whatever owns the queue, and coroutines from any scheduler can be
+//       on it. `count` may be read without the lock to skip waking up nobody.
+static void coroutine__wait_push(CoroutineWaitQueue* queue, int id) {
+    Coroutine* coroutine = coroutine__at(id);
+#if COROUTINE_IS_THREADED
+    coroutine->wait_inbox = g_scheduler->inbox;
+#else
+    coroutine->wait_inbox = g_scheduler;
+#endif
+    coroutine->wait_id   = id;
+    coroutine->wait_next = NULL;
+    coroutine->wait_prev = queue->tail;
+    if (queue->tail != NULL)
+        queue->tail->wait_next = coroutine;
+    else
+        queue->head = coroutine;
+    queue->tail = coroutine;
+    __atomic_store_n(&coroutine->wait_queue, queue, __ATOMIC_RELAXED);
+    __atomic_store_n(&queue->count, queue->count + 1, __ATOMIC_RELAXED);
+}
+
+
+static void coroutine__wait_remove(CoroutineWaitQueue* queue, Coroutine* coroutine) {
+    if (coroutine->wait_queue != queue)
+        return;
+
+    if (coroutine->wait_prev != NULL)
+        coroutine->wait_prev->wait_next = coroutine->wait_next;
+    else
+        queue->head = coroutine->wait_next;
+    if (coroutine->wait_next != NULL)
+        coroutine->wait_next->wait_prev = coroutine->wait_prev;
+    else
+        queue->tail = coroutine->wait_prev;
+    __atomic_store_n(&coroutine->wait_queue, NULL, __ATOMIC_RELAXED);
+    __atomic_store_n(&queue->count, queue->count - 1, __ATOMIC_RELAXED);
+}
+
+
+// NOTE: Who to wake up once the lock of a wait queue is released, as waking
+//       up a coroutine of another thread can make it run right away, only to
+//       spin on the lock we still hold.
+typedef struct CoroutineWaiter {
+    void* inbox;
+    int   id;
+} CoroutineWaiter;
+
+#define COROUTINE__WAKE_BATCH 16
+
+// NOTE: Takes up to `count` coroutines off the front of the queue, with its
+//       lock held. Returns how many it took.
+static int coroutine__wait_pop(CoroutineWaitQueue* queue, CoroutineWaiter* waiters, int count) {
+    int popped = 0;
+    while (popped < count && queue->head != NULL) {
+        Coroutine* coroutine = queue->head;
+        coroutine__wait_remove(queue, coroutine);
+        waiters[popped++] = (CoroutineWaiter) { coroutine->wait_inbox, coroutine->wait_id };
+    }
+    return popped;
+}
+
+
+static void coroutine__wake_waiters(const CoroutineWaiter* waiters, int count) {
+    for (int i = 0; i < count; ++i)
+        coroutine__wake_waiter(waiters[i].inbox, waiters[i].id);
+}
+
+
+// NOTE: Wakes up everyone on the queue, taking `lock` for each batch. Those
+//       who start waiting meanwhile might be woken up too, which is harmless
+//       as every waiter checks its condition again.
+static void coroutine__wait_wake_all(int* lock, CoroutineWaitQueue* queue) {
+    CoroutineWaiter waiters[COROUTINE__WAKE_BATCH];
+    int count;
+    do {
+        coroutine__lock(lock);
+        count = coroutine__wait_pop(queue, waiters, COROUTINE__WAKE_BATCH);
+        coroutine__unlock(lock);
+        coroutine__wake_waiters(waiters, count);
+    } while (count == COROUTINE__WAKE_BATCH);
+}
+
+
+// NOTE: Never inlined, so the thread-local tables are looked up again after
+//       a switch, as a stealable coroutine might resume on another thread.
+__attribute__((noinline))
+static Coroutine* coroutine__current(void) {
+    return coroutine__at(g_scheduler->current);
+}
+
+
+#if defined(COROUTINE_POLL_EPOLL)
+// NOTE: Marks the steal notification pipe, which stays registered (without
+//       EPOLLONESHOT) for as long as the scheduler takes part in stealing.
+//       The inbox is registered the same way for as long as the scheduler has one.
+#define COROUTINE__EPOLL_NOTIFY (~0ull)
+#define COROUTINE__EPOLL_INBOX  (~1ull)
+
+static int coroutine__epoll_setup(void) {
+    if (g_scheduler->epoll_fd < 0) {
+        g_scheduler->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (g_scheduler->epoll_fd < 0) {
+            perror("epoll_create1");
+            return 0;
+        }
+    }
+
+#if defined(COROUTINE_WORK_STEALING)
+    if (g_scheduler->steal != NULL && !g_scheduler->steal_epoll) {
+        struct epoll_event event = { .events = EPOLLIN, .data.u64 = COROUTINE__EPOLL_NOTIFY };
+        if (epoll_ctl(g_scheduler->epoll_fd, EPOLL_CTL_ADD, g_scheduler->steal->notify[0], &event) == 0 || errno == EEXIST)
+            g_scheduler->steal_epoll = 1;
+    }
+#endif
+#if COROUTINE_IS_THREADED
+    if (g_scheduler->inbox != NULL && !g_scheduler->inbox_epoll) {
+        struct epoll_event event = { .events = EPOLLIN, .data.u64 = COROUTINE__EPOLL_INBOX };
+        if (epoll_ctl(g_scheduler->epoll_fd, EPOLL_CTL_ADD, g_scheduler->inbox->fd[0], &event) == 0 || errno == EEXIST)
+            g_scheduler->inbox_epoll = 1;
+    }
+#endif
+    return 1;
+}
+
+
+static int coroutine__epoll_register(int fd, uint32_t events) {
+    struct epoll_event event = {
+        .events = events | EPOLLONESHOT,
+        .data.u64 = (uint32_t)fd,
+    };
+
+    // NOTE: The fd stays registered after it fires, so re-arming is a single
+    //       EPOLL_CTL_MOD. A closed fd is dropped by the kernel, which makes
+    //       the MOD fail with ENOENT and we register it again.
+    if (epoll_ctl(g_scheduler->epoll_fd, EPOLL_CTL_MOD, fd, &event) == 0)
+        return 1;
+    if (errno == ENOENT && epoll_ctl(g_scheduler->epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0)
+        return 1;
+
+    // NOTE: epoll refuses fds that are always ready (e.g. regular files) with EPERM.
+    return 0;
+}
+
+
+static int coroutine__epoll_arm(int id, int fd, CoroutineMode mode) {
+    if (!coroutine__epoll_setup())
+        return 0;
+
+    if (fd >= g_scheduler->epoll_waiter_capacity) {
+        int capacity = g_scheduler->epoll_waiter_capacity * 2;
+        if (capacity <= fd)
+            capacity = fd + 64;
+        CoroutineEpollFd* waiters = realloc(g_scheduler->epoll_waiters, capacity * sizeof(CoroutineEpollFd));
+        if (waiters == NULL) {
+            perror("realloc");
+            return 0;
+        }
+        for (int i = g_scheduler->epoll_waiter_capacity; i < capacity; ++i)
+            waiters[i] = (CoroutineEpollFd) { .readers = -1, .writers = -1 };
+        g_scheduler->epoll_waiters = waiters;
+        g_scheduler->epoll_waiter_capacity = capacity;
+    }
+
+    // NOTE: The fd is registered for every direction that's waited on, as
+    //       MOD replaces what it was registered for.
+    CoroutineEpollFd* waiters = &g_scheduler->epoll_waiters[fd];
+    uint32_t events = (mode == CM_WAIT_READ) ? EPOLLIN : EPOLLOUT;
+    if (waiters->readers >= 0)
+        events |= EPOLLIN;
+    if (waiters->writers >= 0)
+        events |= EPOLLOUT;
+    if (!coroutine__epoll_register(fd, events))
+        return 0;
+
+    int* list = coroutine__epoll_list(fd, (mode == CM_WAIT_READ) ? POLLIN : POLLOUT);
+    Coroutine* coroutine = coroutine__at(id);
+    coroutine->flags |= COROUTINE__EPOLL_LINKED;
+    coroutine->epoll_prev = -1;
+    coroutine->epoll_next = *list;
+    if (*list >= 0)
+        coroutine__at(*list)->epoll_prev = id;
+    *list = id;
+    return 1;
+}
+
+
+// NOTE: Wakes up everyone on the list, which they're taken off as they stop sleeping.
+static void coroutine__epoll_wake(int* list) {
+    while (*list >= 0) {
+        int id = *list;
+        coroutine__sleep_remove(coroutine__at(id)->sleep_index);
+        coroutine__activate(id);
+        COROUTINE__COUNT(ready, 1);
+    }
+}
+
+
+static void coroutine__poll_fds(int timeout) {
+    COROUTINE_ASSERT(safety_check());
+    if (g_scheduler->sleep_count == 0 && coroutine__steal_fd() < 0 && (timeout == 0 || coroutine__inbox_fd() < 0)) {
+        // NOTE: Only timers are pending, so just sleep until the nearest one.
+        if (timeout != 0)
+            poll(NULL, 0, timeout);
+        return;
+    }
+    if (!coroutine__epoll_setup())
+        return;
+
+    int ready_count;
+    while ((ready_count = epoll_wait(g_scheduler->epoll_fd, g_scheduler->epoll_events, COROUTINE_EPOLL_BATCH, timeout)) < 0) {
+        // NOTE: A signal might have woken a coroutine up, which the caller
+        //       looks for before it waits again.
+        if (errno == EINTR) {
+            ready_count = 0;
+            break;
+        } else {
+            perror("epoll_wait");
+            COROUTINE_LOG(g_scheduler->current, "epoll_wait returned errno %d with %d active", errno, g_scheduler->active_count);
+        }
+    }
+
+    for (int i = 0; i < ready_count; ++i) {
+        uint64_t data = g_scheduler->epoll_events[i].data.u64;
+        if (data == COROUTINE__EPOLL_NOTIFY) {
+            coroutine__steal_notified();
+            continue;
+        }
+        if (data == COROUTINE__EPOLL_INBOX)
+            continue;
+
+        int fd = (int)data;
+        COROUTINE_ASSERT(0 <= fd && fd < g_scheduler->epoll_waiter_capacity);
+
+        // NOTE: Errors and hang-ups wake both directions, like poll() reports
+        //       them to either. Waiters on a direction that didn't fire are
+        //       registered again, since EPOLLONESHOT disabled the fd.
+        uint32_t revents = g_scheduler->epoll_events[i].events;
+        CoroutineEpollFd* waiters = &g_scheduler->epoll_waiters[fd];
+        if (revents & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            coroutine__epoll_wake(&waiters->readers);
+        if (revents & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+            coroutine__epoll_wake(&waiters->writers);
+
+        uint32_t rearm = ((waiters->readers >= 0) ? EPOLLIN : 0) | ((waiters->writers >= 0) ? EPOLLOUT : 0);
+        if (rearm != 0)
+            coroutine__epoll_register(fd, rearm);
+    }
+    COROUTINE_ASSERT(safety_check());
+}
+#else
+static void coroutine__poll_fds(int timeout) {
+    COROUTINE_ASSERT(safety_check());
+    if (g_scheduler->sleep_count == 0 && timeout == 0)
+        return;
+
+    // NOTE: An idle scheduler also waits on its steal notification and its
+    //       inbox, which go in the spare entries after the sleeping coroutines.
+    int poll_count = g_scheduler->sleep_count;
+    int notify_fd  = coroutine__steal_fd();
+    int inbox_fd   = (timeout != 0) ? coroutine__inbox_fd() : -1;
+    if (notify_fd >= 0)
+        g_scheduler->polls[poll_count++] = (struct pollfd) { .fd = notify_fd, .events = POLLIN };
+    if (inbox_fd >= 0)
+        g_scheduler->polls[poll_count++] = (struct pollfd) { .fd = inbox_fd, .events = POLLIN };
+
+    while (poll(g_scheduler->polls, poll_count, timeout) < 0) {
+        // NOTE: A signal might have woken a coroutine up, which the caller
+        //       looks for before it waits again.
+        if (errno == EINTR) {
+            break;
+        } else {
+            perror("poll");
+            COROUTINE_LOG(g_scheduler->current, "poll returned errno %d with %d active", errno, g_scheduler->active_count);
+        }
+    }
+
+    if (notify_fd >= 0 && g_scheduler->polls[g_scheduler->sleep_count].revents != 0)
+        coroutine__steal_notified();
+
+    for (int i = 0; i < g_scheduler->sleep_count;) {
+        int id = g_scheduler->sleeping[i];
+        if (g_scheduler->polls[i].revents != 0) {
+            coroutine__sleep_remove(i);
+            coroutine__activate(id);
+            COROUTINE__COUNT(ready, 1);
+        } else {
+            i += 1;
+        }
+    }
+    COROUTINE_ASSERT(safety_check());
+}
+#endif
+
+
+#if defined(COROUTINE_IO_URING)
+static int coroutine__ring_setup(void) {
+    if (g_scheduler->ring.fd != -1)
+        return g_scheduler->ring.fd >= 0;
+
+    // NOTE: Any failure here (old kernel, seccomp, ...) makes this scheduler
+    //       fall back to the poll backend for good.
+    g_scheduler->ring.fd = -2;
+
+    struct io_uring_params params = { 0 };
+    int fd = (int) syscall(__NR_io_uring_setup, COROUTINE_IO_URING_ENTRIES, &params);
+    if (fd < 0) {
+        COROUTINE_LOG(coroutine_id(), "io_uring unavailable (errno %d), using poll", errno);
+        return 0;
+    }
+
+    // NOTE: Fast poll (5.7) implies READ/WRITE and lets non-blocking sockets
+    //       wait for data inside the kernel instead of failing with EAGAIN.
+    //       Extended arguments (5.11) let a wait time out at the next timer.
+    const unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_FAST_POLL | IORING_FEAT_EXT_ARG;
+    if ((params.features & required) != required) {
+        close(fd);
+        return 0;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes  + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ring_size = sq_size > cq_size ? sq_size : cq_size;
+
+    char* ring = mmap(NULL, ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED) {
+        close(fd);
+        return 0;
+    }
+
+    size_t sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes = mmap(NULL, sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        munmap(ring, ring_size);
+        close(fd);
+        return 0;
+    }
+
+    g_scheduler->ring = (CoroutineRing) {
+        .fd          = fd,
+        .sq_entries  = params.sq_entries,
+        .sq_mask     = *(unsigned*)(ring + params.sq_off.ring_mask),
+        .sq_head     = (unsigned*)(ring + params.sq_off.head),
+        .sq_tail     = (unsigned*)(ring + params.sq_off.tail),
+        .sq_flags    = (unsigned*)(ring + params.sq_off.flags),
+        .cq_mask     = *(unsigned*)(ring + params.cq_off.ring_mask),
+        .cq_head     = (unsigned*)(ring + params.cq_off.head),
+        .cq_tail     = (unsigned*)(ring + params.cq_off.tail),
+        .sqes        = sqes,
+        .cqes        = (struct io_uring_cqe*)(ring + params.cq_off.cqes),
+        .ring        = ring,
+        .ring_size   = ring_size,
+    };
+
+    // NOTE: Submission slot `i` always uses sqe `i`, so the index array is fixed.
+    unsigned* sq_array = (unsigned*)(ring + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; ++i)
+        sq_array[i] = i;
+
+    return 1;
+}
+
+
+static void coroutine__ring_destroy(void) {
+    if (g_scheduler->ring.fd >= 0) {
+        munmap(g_scheduler->ring.sqes, g_scheduler->ring.sq_entries * sizeof(struct io_uring_sqe));
+        munmap(g_scheduler->ring.ring, g_scheduler->ring.ring_size);
+        close(g_scheduler->ring.fd);
+    }
+    g_scheduler->ring = (CoroutineRing) { .fd = -1 };
+}
+
+
+static void coroutine__ring_reap(void) {
+    unsigned head = *g_scheduler->ring.cq_head;
+    unsigned tail = __atomic_load_n(g_scheduler->ring.cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; ++head) {
+        struct io_uring_cqe* cqe = &g_scheduler->ring.cqes[head & g_scheduler->ring.cq_mask];
+        uint64_t data = cqe->user_data;
+        if (data == COROUTINE__RING_IGNORE)
+            continue;
+        if (data == COROUTINE__RING_NOTIFY) {
+            g_scheduler->ring.notify_armed = 0;
+            coroutine__steal_notified();
+            continue;
+        }
+        if (data == COROUTINE__RING_INBOX) {
+            g_scheduler->ring.inbox_armed = 0;
+            continue;
+        }
+
+        int id = (int)(uint32_t)data;
+        COROUTINE_ASSERT(0 <= id && id < g_scheduler->coroutine_count);
+
+        if (data & COROUTINE__RING_COMPLETION) {
+            coroutine__at(id)->io_result = cqe->res;
+            g_scheduler->ring.in_flight -= 1;
+            coroutine__activate(id);
+            COROUTINE__COUNT(ready, 1);
+        } else {
+            // NOTE: The coroutine might have been woken up explicitly since it
+            //       submitted the poll, in which case the completion is stale.
+            int fd = (int)((data & ~COROUTINE__RING_COMPLETION) >> 32);
+            int index = coroutine__at(id)->sleep_index;
+            if (index < g_scheduler->sleep_count && g_scheduler->sleeping[index] == id && g_scheduler->polls[index].fd == fd) {
+                coroutine__sleep_remove(index);
+                coroutine__activate(id);
+                COROUTINE__COUNT(ready, 1);
+            }
+        }
+    }
+
+    __atomic_store_n(g_scheduler->ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+
+static void coroutine__ring_enter(int wait, int timeout) {
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    struct __kernel_timespec ts = { .tv_sec = timeout / 1000, .tv_nsec = (timeout % 1000) * 1000000ll };
+    struct io_uring_getevents_arg arg = { .ts = (uint64_t)(uintptr_t)&ts };
+    if (wait && timeout >= 0)
+        flags |= IORING_ENTER_EXT_ARG;
+
+    int submitted = (int) syscall(__NR_io_uring_enter, g_scheduler->ring.fd, g_scheduler->ring.pending, wait ? 1 : 0, flags, (flags & IORING_ENTER_EXT_ARG) ? &arg : NULL, sizeof(arg));
+    if (submitted >= 0) {
+        g_scheduler->ring.pending -= submitted;
+    } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY && errno != ETIME) {
+        // NOTE: EINTR is a wake-up signal, ETIME is the next timer and EAGAIN/EBUSY
+        //       means the completion queue is full; all are handled by reaping.
+        perror("io_uring_enter");
+        COROUTINE_LOG(g_scheduler->current, "io_uring_enter returned errno %d with %d active", errno, g_scheduler->active_count);
+    }
+    g_scheduler->ring.tick_budget = g_scheduler->active_count;
+}
+
+
+static struct io_uring_sqe* coroutine__ring_sqe(void) {
+    unsigned tail = *g_scheduler->ring.sq_tail;
+    while (tail - __atomic_load_n(g_scheduler->ring.sq_head, __ATOMIC_ACQUIRE) == g_scheduler->ring.sq_entries) {
+        coroutine__ring_enter(0, 0);
+    }
+
+    struct io_uring_sqe* sqe = &g_scheduler->ring.sqes[tail & g_scheduler->ring.sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+
+    __atomic_store_n(g_scheduler->ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    g_scheduler->ring.pending += 1;
+    return sqe;
+}
+
+
+static void coroutine__ring_poll_add(int id, int fd, CoroutineMode mode) {
+    struct io_uring_sqe* sqe = coroutine__ring_sqe();
+    sqe->opcode      = IORING_OP_POLL_ADD;
+    sqe->fd          = fd;
+    sqe->poll_events = (mode == CM_WAIT_READ) ? POLLIN : POLLOUT;
+    sqe->user_data   = ((uint64_t)(uint32_t)fd << 32) | (uint32_t)id;
+}
+
+
+static void coroutine__ring_poll_remove(int id, int fd) {
+    struct io_uring_sqe* sqe = coroutine__ring_sqe();
+    sqe->opcode    = IORING_OP_POLL_REMOVE;
+    sqe->addr      = ((uint64_t)(uint32_t)fd << 32) | (uint32_t)id;
+    sqe->user_data = COROUTINE__RING_IGNORE;
+}
+
+
+#if !defined(COROUTINE_SHARED_STACK)
+static ssize_t coroutine__ring_transfer(int opcode, int fd, const void* buffer, size_t bytes) {
+    struct io_uring_sqe* sqe = coroutine__ring_sqe();
+    sqe->opcode    = opcode;
+    sqe->fd        = fd;
+    sqe->addr      = (uint64_t)(uintptr_t)buffer;
+    sqe->len       = (unsigned)bytes;
+    sqe->off       = (uint64_t)-1;
+    sqe->user_data = COROUTINE__RING_COMPLETION | (uint32_t)coroutine__current_slot();
+
+    coroutine_switch(fd, CM_WAIT_COMPLETION);
+
+    int result = coroutine__current()->io_result;
+    if (result < 0) {
+        errno = -result;
+        return -1;
+    }
+    return result;
+}
+#endif
+
+
+static void coroutine__ring_tick(int timeout) {
+    coroutine__ring_reap();
+    if (g_scheduler->active_count == 0 && timeout != 0) {
+        int notify_fd = coroutine__steal_fd();
+        if (notify_fd >= 0 && !g_scheduler->ring.notify_armed) {
+            struct io_uring_sqe* sqe = coroutine__ring_sqe();
+            sqe->opcode      = IORING_OP_POLL_ADD;
+            sqe->fd          = notify_fd;
+            sqe->poll_events = POLLIN;
+            sqe->user_data   = COROUTINE__RING_NOTIFY;
+            g_scheduler->ring.notify_armed = 1;
+        }
+
+        int inbox_fd = coroutine__inbox_fd();
+        if (inbox_fd >= 0 && !g_scheduler->ring.inbox_armed) {
+            struct io_uring_sqe* sqe = coroutine__ring_sqe();
+            sqe->opcode      = IORING_OP_POLL_ADD;
+            sqe->fd          = inbox_fd;
+            sqe->poll_events = POLLIN;
+            sqe->user_data   = COROUTINE__RING_INBOX;
+            g_scheduler->ring.inbox_armed = 1;
+        }
+
+        // NOTE: Nothing can run, so submit the batch and wait for completions
+        //       (or the next timer) in the same call.
+        coroutine__ring_enter(1, timeout);
+        coroutine__ring_reap();
+    } else if (__atomic_load_n(g_scheduler->ring.sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW) {
+        // NOTE: Completions that didn't fit in the queue are kept by the kernel
+        //       until the next enter that asks for completions, which would
+        //       otherwise only come once nothing can run.
+        int submitted = (int) syscall(__NR_io_uring_enter, g_scheduler->ring.fd, g_scheduler->ring.pending, 0, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted > 0)
+            g_scheduler->ring.pending -= submitted;
+        coroutine__ring_reap();
+    } else if (g_scheduler->ring.pending > 0 && (g_scheduler->ring.tick_budget -= g_scheduler->poll_interval) <= 0) {
+        coroutine__ring_enter(0, 0);
+    }
+}
+#else
+static void coroutine__ring_destroy(void) {}
+#endif
+
+
+static int coroutine__arm(int id, int fd, CoroutineMode mode) {
+#if defined(COROUTINE_IO_URING)
+    if (coroutine__ring_setup()) {
+        coroutine__ring_poll_add(id, fd, mode);
+        return 1;
+    }
+#endif
+#if defined(COROUTINE_POLL_EPOLL)
+    return coroutine__epoll_arm(id, fd, mode);
+#else
+    return 1;
+#endif
+}
+
+
+static void coroutine__sleep_cancel(int index) {
+#if defined(COROUTINE_IO_URING)
+    // NOTE: Don't leave the poll (and its reference to the file) in the kernel.
+    if (g_scheduler->ring.fd >= 0)
+        coroutine__ring_poll_remove(g_scheduler->sleeping[index], g_scheduler->polls[index].fd);
+#endif
+    coroutine__sleep_remove(index);
+}
+
+
+static void coroutine__expire_timers(void) {
+    if (g_scheduler->timer_count == 0)
+        return;
+
+    uint64_t now = coroutine__now();
+    while (g_scheduler->timer_count > 0) {
+        int id = g_scheduler->timers[0];
+        Coroutine* coroutine = coroutine__at(id);
+        if (coroutine->deadline > now)
+            break;
+
+        COROUTINE_LOG(id, "timed out%s", "");
+        coroutine__timer_remove(id);
+        coroutine->timed_out = 1;
+
+        if (coroutine__is_sleeping(id))
+            coroutine__sleep_cancel(coroutine->sleep_index);
+        if (coroutine->flags & COROUTINE__PARKED) {
+            coroutine->flags &= ~COROUTINE__PARKED;
+            g_scheduler->park_count -= 1;
+        }
+        coroutine__activate(id);
+    }
+}
+
+
+static int coroutine__poll_timeout(void) {
+    if (g_scheduler->active_count > 0)
+        return 0;
+    if (g_scheduler->timer_count == 0)
+        return -1;
+
+    uint64_t now = coroutine__now();
+    uint64_t deadline = coroutine__at(g_scheduler->timers[0])->deadline;
+    if (deadline <= now)
+        return 0;
+
+    // NOTE: Round up so we never wake up just before the deadline.
+    uint64_t timeout = (deadline - now + 999999) / 1000000;
+    return timeout > INT32_MAX ? INT32_MAX : (int)timeout;
+}
+
+
+// NOTE: Called before blocking. Keeps the COROUTINE_STACK_IDLE_KEEP most
+//       recently freed stacks committed and drops the pages of the rest, so
+//       the memory of a burst of coroutines is returned once it's over. The
+//       stack we're running on might be on the free list, so it's skipped.
+static void coroutine__reclaim_stacks(void) {
+    if (g_scheduler->idle_stacks <= COROUTINE_STACK_IDLE_KEEP)
+        return;
+
+    char here;
+    int kept = 0;
+    for (int id = g_scheduler->first_free; id != 0 && g_scheduler->idle_stacks > COROUTINE_STACK_IDLE_KEEP; id = coroutine__at(id)->next_free) {
+        Coroutine* free = coroutine__at(id);
+        if (free->stack_base == NULL || (free->flags & COROUTINE__STACK_RECLAIMED))
+            continue;
+        if (kept < COROUTINE_STACK_IDLE_KEEP || ((char*)free->stack_base <= &here && &here < (char*)free->stack_top)) {
+            kept += 1;
+            continue;
+        }
+
+        coroutine__stack_reclaim(free->stack_base, (char*)free->stack_top - (char*)free->stack_base);
+        free->flags |= COROUTINE__STACK_RECLAIMED;
+        g_scheduler->idle_stacks -= 1;
+    }
+}
+
+
+// NOTE: Wake-ups recorded by coroutine_wake_up_from_signal. A handler only
+//       runs on top of its own thread, so it can interrupt a drain but never
+//       runs alongside it, and it appends past the count the drain has seen.
+//       The ids past COROUTINE_SIGNAL_WAKES are lost, so once the count is
+//       above it every coroutine they could have been for is woken up, which
+//       the waits already allow for as a spurious wake-up.
+THREAD_LOCAL int g_signal_wakes[COROUTINE_SIGNAL_WAKES];
+THREAD_LOCAL int g_signal_wake_count = 0;
+
+static void coroutine__signal_drain(void) {
+    int done = 0;
+    int count = __atomic_load_n(&g_signal_wake_count, __ATOMIC_SEQ_CST);
+    while (count != 0) {
+        if (count > COROUTINE_SIGNAL_WAKES) {
+            for (int slot = 0; slot < g_scheduler->coroutine_count; ++slot)
+                coroutine_wake_up(coroutine__tag(slot));
+        } else {
+            for (; done < count; ++done)
+                coroutine_wake_up(__atomic_load_n(&g_signal_wakes[done], __ATOMIC_SEQ_CST));
+        }
+        done = count;
+        if (__atomic_compare_exchange_n(&g_signal_wake_count, &count, 0, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            return;
+    }
+}
+
+
+static void coroutine__poll(void) {
+    coroutine__signal_drain();
+    coroutine__inbox_drain();
+
+#if defined(COROUTINE_IO_URING)
+    int in_flight = g_scheduler->ring.in_flight;
+#else
+    int in_flight = 0;
+#endif
+    if (g_scheduler->sleep_count == 0 && g_scheduler->timer_count == 0 && in_flight == 0 && coroutine__inbox_fd() < 0) {
+        COROUTINE_LOG(g_scheduler->current, "none are sleeping%s", "");
+        return;
+    }
+
+    // NOTE: Others can run, so the check for ready fds, completions and
+    //       timers (usually a syscall) waits for the countdown. Finding
+    //       something halves the interval and finding nothing doubles it.
+    int active_count = g_scheduler->active_count;
+    if (active_count > 0 && --g_scheduler->poll_countdown > 0)
+        return;
+
+    // NOTE: If nothing can run we block until an fd, completion or timer is
+    //       ready, so a sleeping scheduler doesn't spin.
+    do {
+        if (g_scheduler->active_count == 0)
+            coroutine__steal_work();
+
+        int timeout = coroutine__poll_timeout();
+        if (timeout != 0)
+            coroutine__reclaim_stacks();
+#if defined(COROUTINE_IO_URING)
+        if (coroutine__ring_setup()) {
+            coroutine__ring_tick(timeout);
+        } else {
+            coroutine__poll_fds(timeout);
+        }
+#else
+        coroutine__poll_fds(timeout);
+#endif
+        coroutine__stats_polled(timeout != 0);
+        coroutine__steal_wake();
+        coroutine__signal_drain();
+        coroutine__inbox_drain();
+        coroutine__expire_timers();
+    } while (g_scheduler->active_count == 0);
+
+    if (active_count > 0 && g_scheduler->active_count > active_count)
+        g_scheduler->poll_interval = (g_scheduler->poll_interval > 1) ? g_scheduler->poll_interval / 2 : 1;
+    else if (active_count > 0 && g_scheduler->poll_interval < COROUTINE_POLL_INTERVAL)
+        g_scheduler->poll_interval *= 2;
+    g_scheduler->poll_countdown = g_scheduler->poll_interval;
+}
+
+
+extern void coroutine__switch_context(int fd, CoroutineMode mode, void *rsp) __asm__("coroutine__switch_context");
+void coroutine__switch_context(int fd, CoroutineMode mode, void *rsp)
+{
+    coroutine__init();
+    COROUTINE_ASSERT(safety_check());
+
+    // Set current context rsp
+    int active_id = g_scheduler->current;
+    Coroutine* coroutine = coroutine__at(active_id);
+    coroutine->stack_ptr = rsp;
+    coroutine__stack_check(active_id, coroutine);
+    coroutine__stats_suspend(coroutine, mode != CM_YIELD && mode != CM_PARK);
+    if (mode == CM_YIELD)
+        coroutine__trace(CT_SWITCH_OUT, coroutine__tag(active_id), -1);
+    else
+        coroutine__trace(CT_WAIT, coroutine__tag(active_id), (mode == CM_SLEEP || mode == CM_PARK) ? -1 : fd);
+
+    COROUTINE_ASSERT(coroutine->stack_base == NULL || (coroutine->stack_base <= coroutine->stack_ptr && coroutine->stack_ptr <= coroutine->stack_top));
+
+    switch (mode) {
+        case CM_YIELD: {
+            COROUTINE_LOG(g_scheduler->current, "yielding%s", "");
+
+            // Go to the back of the queue
+            coroutine__run_push(active_id);
+        } break;
+        case CM_WAIT_READ:
+        case CM_WAIT_WRITE:
+        case CM_WAIT_COMPLETION:
+        case CM_SLEEP:
+        case CM_PARK: {
+            if (mode == CM_PARK) {
+                COROUTINE_LOG(g_scheduler->current, "is parked%s", "");
+                coroutine->flags |= COROUTINE__PARKED;
+                g_scheduler->park_count += 1;
+            } else if (mode == CM_WAIT_COMPLETION) {
+                COROUTINE_LOG(g_scheduler->current, "is waiting for a completion%s", "");
+#if defined(COROUTINE_IO_URING)
+                g_scheduler->ring.in_flight += 1;
+#endif
+            } else if (mode == CM_SLEEP) {
+                COROUTINE_LOG(g_scheduler->current, "is sleeping%s", "");
+                COROUTINE_ASSERT(coroutine__timer_armed(active_id));
+            } else {
+                COROUTINE_LOG(g_scheduler->current, "is waiting for %s", (mode == CM_WAIT_READ) ? "read" : "write");
+
+                // NOTE: An fd that can't be registered is treated as always ready,
+                //       which is what poll() reports for it, so we just yield.
+                if (!coroutine__arm(active_id, fd, mode)) {
+                    coroutine__timer_remove(active_id);
+                    coroutine__run_push(active_id);
+                    break;
+                }
+
+                // Put current coroutine to sleep. NOTE: POLLIN rather than
+                // POLLRDNORM, which eventfds never report.
+                struct pollfd pfd = {
+                    .fd = fd,
+                    .events = (mode == CM_WAIT_READ) ? POLLIN : POLLOUT,
+                    .revents = 0
+                };
+
+                g_scheduler->sleeping[g_scheduler->sleep_count] = active_id;
+                g_scheduler->polls[g_scheduler->sleep_count] = pfd;
+                coroutine->sleep_index = g_scheduler->sleep_count;
+                g_scheduler->sleep_count += 1;
+                COROUTINE__PEAK(peak_sleeping, g_scheduler->sleep_count);
+            }
+
+            coroutine__deactivate(active_id);
+        } break;
+    }
+
+    coroutine__poll();
+    g_scheduler->current = coroutine__run_next();
+    coroutine__steal_offer();
+
+    coroutine__stats_resume(coroutine__at(g_scheduler->current));
+    coroutine__trace(CT_SWITCH_IN, coroutine__tag(g_scheduler->current), -1);
+    coroutine__resume(g_scheduler->current);
+}
+
+
+#if defined(__x86_64__)
+// NOTE: Entered by the `ret` of the coroutine's entry function rather than a
+//       call, so the stack is 8 bytes off and has to be realigned.
+__attribute__((force_align_arg_pointer))
+#endif
+static void coroutine__return_from_current_coroutine(void)
 {
-    int current_coroutine_id = g_active[g_current_active];
+    int current_coroutine_id = g_scheduler->current;
     COROUTINE_ASSERT(current_coroutine_id > 0);
-    Coroutine* coroutine = &g_coroutines[current_coroutine_id];
+    Coroutine* coroutine = coroutine__at(current_coroutine_id);
 
-    COROUTINE_ASSERT(g_active_count > 0);
-    g_active[g_current_active] = g_active[--g_active_count];
+    // NOTE: Still on the coroutine's stack, so its copy of the argument is
+    //       intact. The callback must not switch.
+    coroutine__trace(CT_EXIT, coroutine__tag(current_coroutine_id), -1);
+    if (coroutine->destroy != NULL)
+        coroutine->destroy((char*)coroutine->stack_top - ((coroutine->arg_size + 15) & ~(size_t)15), coroutine->arg_size);
+
+    while (coroutine->joiners.head != NULL) {
+        Coroutine* joiner = coroutine->joiners.head;
+        coroutine__wait_remove(&coroutine->joiners, joiner);
+        coroutine__unpark(joiner->wait_id);
+    }
+    coroutine->generation = (coroutine->generation + 1) & COROUTINE__GENERATION_MASK;
+
+    coroutine__stack_check(current_coroutine_id, coroutine);
+    coroutine__stack_record(coroutine);
+    coroutine__deactivate(current_coroutine_id);
+    coroutine__stats_exit();
 
     char* stack_base = coroutine->stack_base;
     COROUTINE_ASSERT(stack_base != NULL);
 
-    coroutine->next_free = g_first_free;
-    g_first_free = current_coroutine_id;
+#if defined(COROUTINE_SHARED_STACK)
+    // NOTE: Nothing on the stack is needed anymore, so it's never saved.
+    free(coroutine->saved);
+    coroutine->saved          = NULL;
+    coroutine->saved_capacity = 0;
+    g_scheduler->shared_owner = 0;
+#else
+    g_scheduler->idle_stacks += 1;
+#endif
+    coroutine->next_free = g_scheduler->first_free;
+    g_scheduler->first_free = current_coroutine_id;
 
-    if (g_active_count == 0) {
+    if (g_scheduler->active_count == 0)
         coroutine__poll();
-    } else if (g_current_active == g_active_count) {
-        g_current_active = 0;
-    }
+    g_scheduler->current = coroutine__run_next();
+    coroutine__steal_offer();
 
-    int next_active_id = g_active[g_current_active];
-    Coroutine* next_coroutine = &g_coroutines[next_active_id];
-    void* rsp = next_coroutine->stack_ptr;
-
-    COROUTINE_ASSERT(rsp != NULL);
+    int next_active_id = g_scheduler->current;
+    COROUTINE_ASSERT(coroutine__at(next_active_id)->stack_ptr != NULL);
     COROUTINE_ASSERT(safety_check());
-    coroutine__restore_context(rsp);
+    coroutine__stats_resume(coroutine__at(next_active_id));
+    coroutine__trace(CT_SWITCH_IN, coroutine__tag(next_active_id), -1);
+    coroutine__resume(next_active_id);
 }
 
 
 int coroutine_id(void) {
-    return g_active[g_current_active];
+    return g_scheduler->capacity ? coroutine__tag(g_scheduler->current) : 0;
 }
 
 
 void coroutine_wake_up(int id) {
-    for (int i = 0; i < g_sleep_count; i++) {
-        if (g_sleeping[i] == id) {
-            g_polls[i]    = g_polls[g_sleep_count-1];
-            g_sleeping[i] = g_sleeping[g_sleep_count-1];
-            g_sleep_count -= 1;
-            g_active[g_active_count++] = id;
-            return;
-        }
+    // NOTE: Without tables nothing sleeps, and they aren't allocated here.
+    id = coroutine__slot(id);
+    if (id < 0 || coroutine__is_active(id))
+        return;
+
+    if (coroutine__at(id)->flags & COROUTINE__PARKED) {
+        coroutine__unpark(id);
+        return;
+    }
+
+    if (coroutine__is_sleeping(id)) {
+        coroutine__sleep_cancel(coroutine__at(id)->sleep_index);
+        coroutine__activate(id);
+        return;
+    }
+
+    // NOTE: Coroutines in coroutine_sleep_ms only have a timer.
+    if (coroutine__timer_armed(id)) {
+        coroutine__timer_remove(id);
+        coroutine__activate(id);
+    }
+}
+
+
+void coroutine_wake_up_from_signal(int id) {
+    int index = __atomic_fetch_add(&g_signal_wake_count, 1, __ATOMIC_SEQ_CST);
+    if (index < COROUTINE_SIGNAL_WAKES)
+        __atomic_store_n(&g_signal_wakes[index], id, __ATOMIC_SEQ_CST);
+}
+
+
+void coroutine_sleep_ms(int ms) {
+    if (ms <= 0) {
+        coroutine_yield();
+        return;
+    }
+
+    coroutine__init();
+    coroutine__timer_add(coroutine__current_slot(), coroutine__now() + (uint64_t)ms * 1000000ull);
+    coroutine_switch(0, CM_SLEEP);
+}
+
+
+int coroutine_wait_timeout(int fd, CoroutineMode mode, int timeout_ms) {
+    COROUTINE_ASSERT(mode == CM_WAIT_READ || mode == CM_WAIT_WRITE);
+    if (timeout_ms < 0) {
+        coroutine_switch(fd, mode);
+        return 1;
     }
+
+    coroutine__init();
+    coroutine__timer_add(coroutine__current_slot(), coroutine__now() + (uint64_t)timeout_ms * 1000000ull);
+    coroutine_switch(fd, mode);
+    return !coroutine__current()->timed_out;
+}
+
+
+// NOTE: Resumes `id` right away and puts the caller at the back of its queue,
+//       like a yield. A parked target is woken up, as parked coroutines
+//       expect spurious wake-ups. Returns 0 without switching if the target
+//       can't run, i.e. it's waiting for an fd, a timer or a completion, or
+//       it has finished.
+int coroutine_switch_to(int id) {
+    coroutine__init();
+    int slot = coroutine__slot(id);
+    if (slot < 0 || slot == g_scheduler->current)
+        return 0;
+
+    if (coroutine__is_active(slot))
+        coroutine__run_remove(slot);
+    else if (!coroutine__unpark_unqueued(slot))
+        return 0;
+
+    g_scheduler->handoff = slot;
+    coroutine_yield();
+    return 1;
+}
+
+
+// NOTE: Returns 0 once the coroutine has finished (right away if it already
+//       has), and -1 if it's the caller itself. A coroutine that's being
+//       joined isn't offered to other schedulers.
+int coroutine_join(int id) {
+    coroutine__init();
+    int slot = coroutine__slot(id);
+    if (slot < 0)
+        return 0;
+    if (slot == coroutine__current_slot())
+        return -1;
+
+    Coroutine* coroutine = coroutine__at(slot);
+    coroutine__wait_push(&coroutine->joiners, coroutine__current_slot());
+    while (coroutine__current()->wait_queue == &coroutine->joiners)
+        coroutine_switch(0, CM_PARK);
+    return 0;
 }
 
 
 int coroutine_active(void) {
-    return g_active_count;
+    return g_scheduler->active_count;
+}
+
+
+CoroutineScheduler* coroutine_scheduler_create(void) {
+    CoroutineScheduler* scheduler = malloc(sizeof(*scheduler));
+    if (scheduler == NULL)
+        return NULL;
+    *scheduler = (CoroutineScheduler) COROUTINE__SCHEDULER_DEFAULTS;
+    return scheduler;
+}
+
+
+void coroutine_scheduler_destroy(CoroutineScheduler* scheduler) {
+    if (scheduler == NULL)
+        return;
+    COROUTINE_ASSERT(scheduler != g_scheduler && scheduler != &g_default_scheduler);
+
+    // NOTE: It's not running, so it's on its own coroutine 0 as
+    //       coroutine_destroy_all expects, whichever coroutine calls this.
+    CoroutineScheduler* current = g_scheduler;
+    g_current_scheduler = scheduler;
+    coroutine_destroy_all();
+    g_current_scheduler = current;
+    free(scheduler);
+}
+
+
+CoroutineScheduler* coroutine_scheduler_current(void) {
+    return g_scheduler;
+}
+
+
+CoroutineScheduler* coroutine_scheduler_enter(CoroutineScheduler* scheduler) {
+    CoroutineScheduler* previous = g_scheduler;
+    COROUTINE_ASSERT(previous->current == 0);
+    g_current_scheduler = (scheduler != NULL) ? scheduler : &g_default_scheduler;
+    COROUTINE_ASSERT(g_current_scheduler->current == 0);
+    return previous;
+}
+
+
+#if COROUTINE_STATS
+static uint64_t coroutine__ticks_to_ns(uint64_t ticks) {
+#if !COROUTINE_STATS_TIME
+    return 0;
+#else
+    return (uint64_t)(((unsigned __int128)ticks * coroutine__cycle_scale()) >> 32);
+#endif
+}
+
+
+static void coroutine__stats_read(CoroutineCounters* counters, CoroutineSchedulerStats* stats) {
+    *stats = (CoroutineSchedulerStats) {
+        .switches      = __atomic_load_n(&counters->switches,      __ATOMIC_RELAXED),
+        .run_ns        = coroutine__ticks_to_ns(__atomic_load_n(&counters->run_ticks,  __ATOMIC_RELAXED)),
+        .idle_ns       = coroutine__ticks_to_ns(__atomic_load_n(&counters->idle_ticks, __ATOMIC_RELAXED)),
+        .polls         = __atomic_load_n(&counters->polls,         __ATOMIC_RELAXED),
+        .ready         = __atomic_load_n(&counters->ready,         __ATOMIC_RELAXED),
+        .creates       = __atomic_load_n(&counters->creates,       __ATOMIC_RELAXED),
+        .exits         = __atomic_load_n(&counters->exits,         __ATOMIC_RELAXED),
+        .active        = __atomic_load_n(&counters->active,        __ATOMIC_RELAXED),
+        .peak_active   = __atomic_load_n(&counters->peak_active,   __ATOMIC_RELAXED),
+        .sleeping      = __atomic_load_n(&counters->sleeping,      __ATOMIC_RELAXED),
+        .peak_sleeping = __atomic_load_n(&counters->peak_sleeping, __ATOMIC_RELAXED),
+    };
+}
+#endif
+
+
+int coroutine_stats(int id, CoroutineStats* stats) {
+    *stats = (CoroutineStats) { 0 };
+    int slot = coroutine__slot(id);
+    if (slot < 0)
+        return 0;
+
+#if COROUTINE_STATS
+    // NOTE: Includes the time it's been running or waiting for so far.
+    Coroutine* coroutine = coroutine__at(slot);
+    uint64_t now        = coroutine__ticks();
+    uint64_t run_ticks  = coroutine->run_ticks;
+    uint64_t wait_ticks = coroutine->wait_ticks;
+    if (slot == g_scheduler->current)
+        run_ticks += now - g_scheduler->stats_since;
+    if (coroutine->wait_since != 0)
+        wait_ticks += now - coroutine->wait_since;
+
+    stats->switches = coroutine->switches;
+    stats->run_ns   = coroutine__ticks_to_ns(run_ticks);
+    stats->wait_ns  = coroutine__ticks_to_ns(wait_ticks);
+#endif
+    return 1;
+}
+
+
+void coroutine_scheduler_stats(CoroutineSchedulerStats* stats) {
+    *stats = (CoroutineSchedulerStats) { 0 };
+#if COROUTINE_STATS
+    coroutine__init();
+    coroutine__stats_read(g_scheduler->counters, stats);
+    stats->run_ns  += coroutine__ticks_to_ns(coroutine__ticks() - g_scheduler->stats_since);
+    stats->active   = g_scheduler->active_count;
+    stats->sleeping = g_scheduler->sleep_count;
+#endif
+}
+
+
+int coroutine_scheduler_stats_all(CoroutineSchedulerStats* stats, int count) {
+    int written = 0;
+#if COROUTINE_STATS
+    for (int i = 0; i < COROUTINE__SCHEDULER_SLOTS && written < count; ++i) {
+        CoroutineCounters* counters = &g_counter_slots[i];
+        if (!__atomic_load_n(&counters->owned, __ATOMIC_ACQUIRE))
+            continue;
+        if (counters == g_scheduler->counters)
+            coroutine_scheduler_stats(&stats[written++]);
+        else
+            coroutine__stats_read(counters, &stats[written++]);
+    }
+#endif
+    return written;
+}
+
+
+size_t coroutine_stack_used(int id) {
+#if defined(COROUTINE_STACK_PROFILE)
+    int slot = coroutine__slot(id);
+    if (slot < 0 || coroutine__at(slot)->stack_base == NULL)
+        return 0;
+    return coroutine__stack_used(coroutine__at(slot));
+#else
+    return 0;
+#endif
+}
+
+
+int coroutine_stack_profile(CoroutineStackProfile* profiles, int count) {
+    int found = 0;
+#if defined(COROUTINE_STACK_PROFILE)
+    coroutine__lock(&g_stack_profile_lock);
+    for (int i = 0; i < COROUTINE_STACK_PROFILE_ENTRIES; ++i) {
+        if (g_stack_profiles[i].entry == NULL)
+            continue;
+        if (found < count)
+            profiles[found] = g_stack_profiles[i];
+        found += 1;
+    }
+    coroutine__unlock(&g_stack_profile_lock);
+#endif
+    return found;
+}
+
+
+void coroutine_trace(int type, int id, int fd) {
+#if defined(COROUTINE_TRACE)
+    coroutine__init();
+    coroutine__trace(type, id, fd);
+#endif
+}
+
+
+#if defined(COROUTINE_TRACE)
+static int coroutine__write_all(int fd, const void* data, size_t size) {
+    const char* bytes = data;
+    while (size > 0) {
+        ssize_t written = write(fd, bytes, size);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return -1;
+        bytes += written;
+        size  -= (size_t)written;
+    }
+    return 0;
+}
+#endif
+
+
+int coroutine_trace_dump(int fd) {
+#if defined(COROUTINE_TRACE)
+    // NOTE: Rings are only ever added, so a snapshot of the slots stays valid.
+    CoroutineTraceRing* rings[COROUTINE__SCHEDULER_SLOTS];
+    int slots[COROUTINE__SCHEDULER_SLOTS];
+    int ring_count = 0;
+    for (int i = 0; i < COROUTINE__SCHEDULER_SLOTS; ++i) {
+        CoroutineTraceRing* ring = __atomic_load_n(&g_trace_rings[i], __ATOMIC_ACQUIRE);
+        if (ring != NULL) {
+            rings[ring_count] = ring;
+            slots[ring_count] = i;
+            ring_count += 1;
+        }
+    }
+
+    CoroutineTraceHeader header = {
+        .magic       = COROUTINE_TRACE_MAGIC,
+        .version     = COROUTINE_TRACE_VERSION,
+        .threads     = (unsigned)ring_count,
+        .ns_per_tick = coroutine__cycle_scale(),
+    };
+    if (coroutine__write_all(fd, &header, sizeof(header)) < 0)
+        return -1;
+
+    CoroutineTraceEvent* events = malloc(COROUTINE_TRACE_SIZE * sizeof(*events));
+    if (events == NULL)
+        return -1;
+
+    for (int i = 0; i < ring_count; ++i) {
+        CoroutineTraceRing* ring = rings[i];
+        uint64_t head  = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t first = (head > COROUTINE_TRACE_SIZE) ? head - COROUTINE_TRACE_SIZE : 0;
+        for (uint64_t j = first; j < head; ++j)
+            events[j - first] = ring->events[j & (COROUTINE_TRACE_SIZE - 1)];
+
+        // NOTE: The owner may have moved on while we copied, and the slot it
+        //       writes next might already be half-written.
+        uint64_t now   = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t valid = (now + 1 > COROUTINE_TRACE_SIZE) ? now + 1 - COROUTINE_TRACE_SIZE : 0;
+        uint64_t start = (valid > first) ? valid : first;
+        if (start > head)
+            start = head;
+
+        CoroutineTraceThread thread = { .thread = (unsigned)slots[i], .count = (unsigned)(head - start) };
+        if (coroutine__write_all(fd, &thread, sizeof(thread)) < 0 ||
+            coroutine__write_all(fd, events + (start - first), thread.count * sizeof(*events)) < 0) {
+            free(events);
+            return -1;
+        }
+    }
+    free(events);
+    return 0;
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+
+// NOTE: With a shared stack, a buffer on the stack isn't there while the
+//       coroutine is suspended, so the kernel can't be left to fill it and
+//       only the wait goes through the ring.
+ssize_t coroutine_read(int fd, void* buffer, size_t bytes) {
+#if defined(COROUTINE_IO_URING) && !defined(COROUTINE_SHARED_STACK)
+    if (coroutine__ring_setup())
+        return coroutine__ring_transfer(IORING_OP_READ, fd, buffer, bytes);
+#endif
+    coroutine_wait_read(fd);
+    return read(fd, buffer, bytes);
+}
+
+
+ssize_t coroutine_write(int fd, const void* buffer, size_t bytes) {
+#if defined(COROUTINE_IO_URING) && !defined(COROUTINE_SHARED_STACK)
+    if (coroutine__ring_setup())
+        return coroutine__ring_transfer(IORING_OP_WRITE, fd, buffer, bytes);
+#endif
+    coroutine_wait_write(fd);
+    return write(fd, buffer, bytes);
+}
+
+
+struct CoroutineChannel {
+    uint64_t head;                          // Next cell to receive from.
+    char     head_padding[64 - sizeof(uint64_t)];
+    uint64_t tail;                          // Next cell to send to.
+    char     tail_padding[64 - sizeof(uint64_t)];
+    uint64_t mask;
+    size_t   value_size;
+    size_t   cell_size;
+    char*    cells;
+    int      closed;
+    int      lock;                          // Protects the wait queues.
+    CoroutineWaitQueue senders;
+    CoroutineWaitQueue receivers;
+};
+
+
+// NOTE: The values are kept in a bounded lock-free ring (Vyukov's MPMC
+//       queue). Each cell starts with a sequence number that tells whether
+//       it's free for the sender at `tail` or filled for the receiver at
+//       `head`, so neither side needs a lock or a syscall unless it has to
+//       wait, and waking a coroutine on the same scheduler is just an unpark.
+CoroutineChannel* coroutine_channel_create(size_t value_size, int capacity) {
+    uint64_t count = 2;
+    while (count < (uint64_t)capacity)
+        count *= 2;
+
+    size_t cell_size = (sizeof(uint64_t) + value_size + 7) & ~(size_t)7;
+    CoroutineChannel* channel = calloc(1, sizeof(CoroutineChannel));
+    char* cells = malloc(count * cell_size);
+    if (channel == NULL || cells == NULL) {
+        free(channel);
+        free(cells);
+        return NULL;
+    }
+
+    for (uint64_t i = 0; i < count; ++i)
+        *(uint64_t*)(cells + i * cell_size) = i;
+
+    channel->mask       = count - 1;
+    channel->value_size = value_size;
+    channel->cell_size  = cell_size;
+    channel->cells      = cells;
+    return channel;
+}
+
+
+// NOTE: Nothing may be waiting on the channel anymore.
+void coroutine_channel_destroy(CoroutineChannel* channel) {
+    if (channel == NULL)
+        return;
+    COROUTINE_ASSERT(channel->senders.count == 0 && channel->receivers.count == 0);
+    free(channel->cells);
+    free(channel);
+}
+
+
+static uint64_t* coroutine__channel_cell(CoroutineChannel* channel, uint64_t position) {
+    return (uint64_t*)(channel->cells + (position & channel->mask) * channel->cell_size);
+}
+
+
+// NOTE: Called after a successful send or receive. The fence pairs with the
+//       one in coroutine__channel_wait, so either we see the waiter or it
+//       sees what we did.
+static void coroutine__channel_wake(CoroutineChannel* channel, CoroutineWaitQueue* queue) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&queue->count, __ATOMIC_RELAXED) == 0)
+        return;
+
+    CoroutineWaiter waiter;
+    coroutine__lock(&channel->lock);
+    int count = coroutine__wait_pop(queue, &waiter, 1);
+    coroutine__unlock(&channel->lock);
+    coroutine__wake_waiters(&waiter, count);
+}
+
+
+int coroutine_channel_try_send(CoroutineChannel* channel, const void* value) {
+    if (__atomic_load_n(&channel->closed, __ATOMIC_ACQUIRE))
+        return -1;
+
+    uint64_t  position = __atomic_load_n(&channel->tail, __ATOMIC_RELAXED);
+    uint64_t* cell;
+    for (;;) {
+        cell = coroutine__channel_cell(channel, position);
+        int64_t difference = (int64_t)(__atomic_load_n(cell, __ATOMIC_ACQUIRE) - position);
+        if (difference == 0) {
+            if (__atomic_compare_exchange_n(&channel->tail, &position, position + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (difference < 0) {
+            return 0;
+        } else {
+            position = __atomic_load_n(&channel->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    memcpy(cell + 1, value, channel->value_size);
+    __atomic_store_n(cell, position + 1, __ATOMIC_RELEASE);
+
+    coroutine__channel_wake(channel, &channel->receivers);
+    return 1;
+}
+
+
+int coroutine_channel_try_recv(CoroutineChannel* channel, void* value) {
+    uint64_t  position = __atomic_load_n(&channel->head, __ATOMIC_RELAXED);
+    uint64_t* cell;
+    for (;;) {
+        cell = coroutine__channel_cell(channel, position);
+        int64_t difference = (int64_t)(__atomic_load_n(cell, __ATOMIC_ACQUIRE) - (position + 1));
+        if (difference == 0) {
+            if (__atomic_compare_exchange_n(&channel->head, &position, position + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (difference < 0) {
+            return __atomic_load_n(&channel->closed, __ATOMIC_ACQUIRE) ? -1 : 0;
+        } else {
+            position = __atomic_load_n(&channel->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    memcpy(value, cell + 1, channel->value_size);
+    __atomic_store_n(cell, position + channel->mask + 1, __ATOMIC_RELEASE);
+
+    coroutine__channel_wake(channel, &channel->senders);
+    return 1;
+}
+
+
+// NOTE: Whether a sender (or receiver) waiting on `queue` could go ahead.
+static int coroutine__channel_ready(CoroutineChannel* channel, CoroutineWaitQueue* queue) {
+    if (__atomic_load_n(&channel->closed, __ATOMIC_ACQUIRE))
+        return 1;
+
+    if (queue == &channel->senders) {
+        uint64_t position = __atomic_load_n(&channel->tail, __ATOMIC_RELAXED);
+        return (int64_t)(__atomic_load_n(coroutine__channel_cell(channel, position), __ATOMIC_ACQUIRE) - position) >= 0;
+    } else {
+        uint64_t position = __atomic_load_n(&channel->head, __ATOMIC_RELAXED);
+        return (int64_t)(__atomic_load_n(coroutine__channel_cell(channel, position), __ATOMIC_ACQUIRE) - (position + 1)) >= 0;
+    }
+}
+
+
+static void coroutine__channel_wait(CoroutineChannel* channel, CoroutineWaitQueue* queue) {
+    coroutine__init();
+
+    // NOTE: Without an inbox another thread couldn't wake us up, so we just
+    //       give the others a turn and try again.
+    if (!coroutine__inbox_setup()) {
+        coroutine_yield();
+        return;
+    }
+
+    coroutine__lock(&channel->lock);
+    coroutine__wait_push(queue, coroutine__current_slot());
+    coroutine__unlock(&channel->lock);
+
+    // NOTE: Look again, as the other side might have made progress before it
+    //       could see us on the queue.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!coroutine__channel_ready(channel, queue))
+        coroutine_switch(0, CM_PARK);
+
+    // NOTE: Still on the queue if we didn't park or were woken up by someone else.
+    coroutine__lock(&channel->lock);
+    coroutine__wait_remove(queue, coroutine__current());
+    coroutine__unlock(&channel->lock);
+}
+
+
+int coroutine_channel_send(CoroutineChannel* channel, const void* value) {
+    int result;
+    while ((result = coroutine_channel_try_send(channel, value)) == 0)
+        coroutine__channel_wait(channel, &channel->senders);
+    return result;
+}
+
+
+int coroutine_channel_recv(CoroutineChannel* channel, void* value) {
+    int result;
+    while ((result = coroutine_channel_try_recv(channel, value)) == 0)
+        coroutine__channel_wait(channel, &channel->receivers);
+    return result;
+}
+
+
+void coroutine_channel_close(CoroutineChannel* channel) {
+    __atomic_store_n(&channel->closed, 1, __ATOMIC_SEQ_CST);
+
+    coroutine__wait_wake_all(&channel->lock, &channel->senders);
+    coroutine__wait_wake_all(&channel->lock, &channel->receivers);
+}
+
+
+// NOTE: Called with `lock` held, which guards the state the caller waits on.
+//       Parks until a coroutine__wait_pop takes us off `queue`, and
+//       returns with `lock` held again. Whoever wakes us up has also done
+//       what we waited for (e.g. handed over the mutex), so we don't race
+//       anyone for it. Without an inbox, another thread couldn't wake us up,
+//       so we yield until we're off the queue instead.
+//
+//       `mutex`, if any, is released once we're on the queue.
+static void coroutine__wait_on(int* lock, CoroutineWaitQueue* queue, CoroutineMutex* mutex) {
+    coroutine__init();
+    CoroutineMode mode = coroutine__inbox_setup() ? CM_PARK : CM_YIELD;
+
+    coroutine__wait_push(queue, coroutine__current_slot());
+    if (mutex != NULL)
+        coroutine_mutex_unlock(mutex);
+    do {
+        coroutine__unlock(lock);
+        coroutine_switch(0, mode);
+        coroutine__lock(lock);
+    } while (coroutine__current()->wait_queue == queue);
+}
+
+
+void coroutine_mutex_lock(CoroutineMutex* mutex) {
+    coroutine__lock(&mutex->lock);
+    if (mutex->locked)
+        coroutine__wait_on(&mutex->lock, &mutex->waiters, NULL);
+    mutex->locked = 1;
+    coroutine__unlock(&mutex->lock);
+}
+
+
+int coroutine_mutex_try_lock(CoroutineMutex* mutex) {
+    coroutine__lock(&mutex->lock);
+    int acquired = !mutex->locked;
+    mutex->locked = 1;
+    coroutine__unlock(&mutex->lock);
+    return acquired;
+}
+
+
+// NOTE: Hands the mutex straight to the first waiter, if any, so it stays locked.
+void coroutine_mutex_unlock(CoroutineMutex* mutex) {
+    CoroutineWaiter waiter;
+    coroutine__lock(&mutex->lock);
+    COROUTINE_ASSERT(mutex->locked);
+    int count = coroutine__wait_pop(&mutex->waiters, &waiter, 1);
+    if (count == 0)
+        mutex->locked = 0;
+    coroutine__unlock(&mutex->lock);
+    coroutine__wake_waiters(&waiter, count);
+}
+
+
+// NOTE: We're on the queue before the mutex is released, so a signal can't be
+//       missed. Like with pthreads, the condition must be checked in a loop.
+void coroutine_cond_wait(CoroutineCond* cond, CoroutineMutex* mutex) {
+    coroutine__lock(&cond->lock);
+    coroutine__wait_on(&cond->lock, &cond->waiters, mutex);
+    coroutine__unlock(&cond->lock);
+    coroutine_mutex_lock(mutex);
+}
+
+
+void coroutine_cond_signal(CoroutineCond* cond) {
+    if (__atomic_load_n(&cond->waiters.count, __ATOMIC_RELAXED) == 0)
+        return;
+
+    CoroutineWaiter waiter;
+    coroutine__lock(&cond->lock);
+    int count = coroutine__wait_pop(&cond->waiters, &waiter, 1);
+    coroutine__unlock(&cond->lock);
+    coroutine__wake_waiters(&waiter, count);
+}
+
+
+void coroutine_cond_broadcast(CoroutineCond* cond) {
+    if (__atomic_load_n(&cond->waiters.count, __ATOMIC_RELAXED) == 0)
+        return;
+
+    coroutine__wait_wake_all(&cond->lock, &cond->waiters);
+}
+
+
+void coroutine_semaphore_init(CoroutineSemaphore* semaphore, int count) {
+    memset(semaphore, 0, sizeof(CoroutineSemaphore));
+    semaphore->count = count;
+}
+
+
+void coroutine_semaphore_acquire(CoroutineSemaphore* semaphore) {
+    coroutine__lock(&semaphore->lock);
+    if (semaphore->count > 0)
+        semaphore->count -= 1;
+    else
+        coroutine__wait_on(&semaphore->lock, &semaphore->waiters, NULL);
+    coroutine__unlock(&semaphore->lock);
+}
+
+
+int coroutine_semaphore_try_acquire(CoroutineSemaphore* semaphore) {
+    coroutine__lock(&semaphore->lock);
+    int acquired = semaphore->count > 0;
+    if (acquired)
+        semaphore->count -= 1;
+    coroutine__unlock(&semaphore->lock);
+    return acquired;
+}
+
+
+// NOTE: Hands the permit straight to the first waiter, if any.
+void coroutine_semaphore_release(CoroutineSemaphore* semaphore) {
+    CoroutineWaiter waiter;
+    coroutine__lock(&semaphore->lock);
+    int count = coroutine__wait_pop(&semaphore->waiters, &waiter, 1);
+    if (count == 0)
+        semaphore->count += 1;
+    coroutine__unlock(&semaphore->lock);
+    coroutine__wake_waiters(&waiter, count);
+}
+
+
+// NOTE: Wakes up everyone waiting once the count drops to zero.
+void coroutine_wait_group_add(CoroutineWaitGroup* group, int count) {
+    coroutine__lock(&group->lock);
+    group->count += count;
+    COROUTINE_ASSERT(group->count >= 0);
+    int done = group->count == 0;
+    coroutine__unlock(&group->lock);
+    if (done)
+        coroutine__wait_wake_all(&group->lock, &group->waiters);
+}
+
+
+void coroutine_wait_group_done(CoroutineWaitGroup* group) {
+    coroutine_wait_group_add(group, -1);
+}
+
+
+void coroutine_wait_group_wait(CoroutineWaitGroup* group) {
+    // NOTE: Looks again, as the group might have been added to after it
+    //       reached zero, but before everyone waiting was woken up.
+    coroutine__lock(&group->lock);
+    while (group->count > 0)
+        coroutine__wait_on(&group->lock, &group->waiters, NULL);
+    coroutine__unlock(&group->lock);
+}
+
+
+// NOTE: Wakes up everyone waiting. It must only be set once.
+void coroutine_future_set(CoroutineFuture* future, void* value) {
+    coroutine__lock(&future->lock);
+    COROUTINE_ASSERT(!future->ready);
+    future->value = value;
+    __atomic_store_n(&future->ready, 1, __ATOMIC_RELEASE);
+    coroutine__unlock(&future->lock);
+    coroutine__wait_wake_all(&future->lock, &future->waiters);
+}
+
+
+void* coroutine_future_get(CoroutineFuture* future) {
+    if (!coroutine_future_ready(future)) {
+        coroutine__lock(&future->lock);
+        if (!future->ready)
+            coroutine__wait_on(&future->lock, &future->waiters, NULL);
+        coroutine__unlock(&future->lock);
+    }
+    return future->value;
+}
+
+
+int coroutine_future_ready(CoroutineFuture* future) {
+    return __atomic_load_n(&future->ready, __ATOMIC_ACQUIRE);
 }
 
 
@@ -12,6 +12,8 @@
 #include <string.h>
 #include <sys/stat.h>
 
+#define IDLE_TIMEOUT_MS (10*1000)
+
 
 typedef struct String {
     char* data;
@@ -71,10 +73,13 @@ void handle_client(TcpContext* ctx) {
 
     while (true) {
         TCP_LOG(tid, cid, "Waiting reading data from client (%s:%d)!", client_address, client->port);
-        ssize_t bytes_read = tcp_read(client, read_buffer, sizeof(read_buffer));
+        ssize_t bytes_read = tcp_read_timeout(client, read_buffer, sizeof(read_buffer), IDLE_TIMEOUT_MS);
         if (bytes_read == 0) {
             TCP_LOG(tid, cid, "Client (%s:%d) disconnected.", client_address, client->port);
             return;
+        } else if (bytes_read < 0 && errno == ETIMEDOUT) {
+            TCP_LOG(tid, cid, "Client (%s:%d) was idle for too long.", client_address, client->port);
+            return;
         } else if (bytes_read < 0) {
             TCP_LOG(tid, cid, "Error reading data from client (%s:%d). Exiting...", client_address, client->port);
             perror("handle_client");
@@ -133,23 +138,25 @@ int main(void)
     inet_ntop(AF_INET, &(server.host), ip_str, INET_ADDRSTRLEN);
     TCP_LOG(0, 0, "Serving at %s:%d", ip_str, server.port);
 
+    TcpClient clients[TCP_ACCEPT_BATCH];
     while (true) {
         TCP_LOG(0, 0, "Waiting for client connection...%s", "");
-        TcpClient client = tcp_accept(&server, handle_client);
-        switch (tcp_client_status(client)) {
-            case TCP_CLIENT_ERROR: {
+        int count = tcp_accept_batch(&server, handle_client, clients, TCP_ACCEPT_BATCH);
+        if (count == 0) {
+            TCP_LOG(0, 0, "Shutting down the server!%s", "");
+            tcp_close(&server);
+            return EXIT_SUCCESS;
+        }
+
+        for (int i = 0; i < count; ++i) {
+            TcpClient client = clients[i];
+            if (tcp_client_status(client) == TCP_CLIENT_ERROR) {
                 TCP_LOG(0, 0, "%s\n", tcp_client_error(client));
-                break;
-            } case TCP_CLIENT_REQUESTED_SHUTDOWN: {
-                TCP_LOG(0, 0, "Shutting down the server!%s", "");
-                tcp_close(&server);
-                return EXIT_SUCCESS;
-            } case TCP_CLIENT_CONNECTED: {
+            } else {
                 char client_address[INET_ADDRSTRLEN];
                 inet_ntop(AF_INET, &client.host, client_address, INET_ADDRSTRLEN);
 
                 TCP_LOG(0, 0, "Client %d connected at %s:%d", client.fd, client_address, client.port);
-                break;
             }
         }
     }
@@ -17,6 +17,34 @@
 #define TCP__THREAD_COUNT TCP_THREAD_COUNT
 #endif
 
+// How tcp_accept picks the worker thread for a client. Workers that are full
+// (TCP_MAX_CLIENTS) are skipped by all of them.
+#define TCP_DISPATCH_ROUND_ROBIN   0    // Each worker in turn.
+#define TCP_DISPATCH_LEAST_CLIENTS 1    // The worker with the fewest clients.
+#define TCP_DISPATCH_TWO_CHOICES   2    // The one with fewer clients of two random workers.
+
+#ifndef TCP_DISPATCH
+#define TCP_DISPATCH TCP_DISPATCH_TWO_CHOICES
+#endif
+
+// Clients a worker serves at once before it counts as full. It's kept well
+// below COROUTINE_MAX_COUNT, which is only a limit on how far the tables
+// can grow, and capped by it.
+#ifndef TCP_MAX_CLIENTS
+#define TCP_MAX_CLIENTS 16384
+#endif
+
+// Most clients accepted per readiness of a listener before the others get a
+// turn (see tcp_accept_batch).
+#ifndef TCP_ACCEPT_BATCH
+#define TCP_ACCEPT_BATCH 64
+#endif
+
+// Clients that can wait for a worker to pick them up, a power of two.
+#ifndef TCP_HANDOFF_SIZE
+#define TCP_HANDOFF_SIZE 256
+#endif
+
 
 typedef struct TcpServer {
     int      fd;
@@ -27,8 +55,11 @@ typedef struct TcpServer {
 #if TCP_THREAD_COUNT > 0
     int thread_count;
     int next_thread;
-    int thread_fds[TCP_THREAD_COUNT];
-    pthread_t threads[TCP_THREAD_COUNT];
+    uint32_t random;
+    struct TcpWorker* workers;
+#if defined(TCP_REUSEPORT)
+    int accepting;      // Whether the workers' acceptors have been started.
+#endif
 #endif
 } TcpServer;
 
@@ -44,6 +75,9 @@ typedef struct TcpContext {
     TcpClient client;
     TcpServer server;
     void (*serve)(struct TcpContext*);
+#if TCP_THREAD_COUNT > 0
+    int worker;     // Index of the worker it was dispatched to.
+#endif
 } TcpContext;
 
 
@@ -55,9 +89,18 @@ typedef enum TcpClientStatus {
 
 
 TcpServer tcp_server(const char* host, uint16_t port, uint16_t backlog);
+// NOTE: With TCP_REUSEPORT the workers accept their own clients. The first
+//       tcp_accept or tcp_accept_batch starts an acceptor with `serve` on
+//       each worker, and every call only returns once a shutdown has been
+//       requested, as a client that's requested shutdown (or 0 clients).
+//       The `serve` of later calls is ignored.
 TcpClient tcp_accept(TcpServer* server, void (*serve)(TcpContext*));
+int       tcp_accept_batch(TcpServer* server, void (*serve)(TcpContext*), TcpClient* clients, int count);
+TcpClient tcp_connect(const char* host, uint16_t port, int timeout_ms);
 ssize_t   tcp_read(TcpClient* client, char* buffer, size_t bytes);
 ssize_t   tcp_write(TcpClient* client, char* buffer, size_t bytes);
+ssize_t   tcp_read_timeout(TcpClient* client, char* buffer, size_t bytes, int timeout_ms);
+ssize_t   tcp_write_timeout(TcpClient* client, char* buffer, size_t bytes, int timeout_ms);
 void      tcp_close(TcpServer* server);
 
 int  tcp_shutdown_requested(void);
@@ -101,6 +144,51 @@ static bool g_termination_signal_sent = false;
 #endif
 
 #define COROUTINE_IS_THREADED (TCP_THREAD_COUNT > 0)
+
+// NOTE: Lets idle worker threads take over runnable clients from busy ones.
+#if defined(TCP_WORK_STEALING) && TCP_THREAD_COUNT > 0
+#define COROUTINE_WORK_STEALING
+#define TCP__CLIENT_FLAGS CF_STEALABLE
+#else
+#define TCP__CLIENT_FLAGS CF_NONE
+#endif
+
+// NOTE: Runs a worker's clients on one stack, so an idle client only costs
+//       as much memory as its stack is deep (see COROUTINE_SHARED_STACK).
+#if defined(TCP_SHARED_STACK)
+#define COROUTINE_SHARED_STACK
+#endif
+
+// NOTE: Records scheduler events, plus accepts and dispatches, and writes
+//       them to TCP_TRACE_FILE when the server is closed (see
+//       tools/trace2chrome.c).
+#if defined(TCP_TRACE)
+#define COROUTINE_TRACE
+#if !defined(TCP_TRACE_FILE)
+#define TCP_TRACE_FILE "trace.bin"
+#endif
+#endif
+
+// NOTE: Measures how much stack the clients use and prints it per handler in
+//       tcp_close, to size TCP_STACK_SIZE by (see COROUTINE_STACK_PROFILE).
+#if defined(TCP_STACK_PROFILE)
+#define COROUTINE_STACK_PROFILE
+#endif
+
+// NOTE: Gives every worker its own listening socket on the server's port, so
+//       each one accepts its own clients and the kernel spreads connections
+//       over them, rather than the main thread accepting all of them and
+//       handing them out. Only Linux balances between the sockets; elsewhere
+//       the last one bound would get every connection.
+#if defined(TCP_REUSEPORT)
+#if TCP_THREAD_COUNT == 0
+#error "TCP_REUSEPORT needs worker threads (TCP_THREAD_COUNT > 0)"
+#endif
+#if !defined(__linux__)
+#error "TCP_REUSEPORT is only supported on Linux"
+#endif
+#endif
+
 #define COROUTINE_LOG(id, message, ...) TCP_LOG(thread_id, id, message, __VA_ARGS__)
 #define COROUTINE_IMPLEMENTATION
 #include "coroutine.h"
@@ -113,16 +201,246 @@ static bool g_termination_signal_sent = false;
 #include <signal.h>
 
 
-static void tcp__on_client_disconnected(void* stack, size_t size) {
-    void** top = (void*)((char*)stack + size + sizeof(TcpContext));
+#if TCP_THREAD_COUNT > 0 && !defined(TCP_REUSEPORT)
+#define TCP__DISPATCHES 1
+#else
+#define TCP__DISPATCHES 0
+#endif
+
+#if TCP_THREAD_COUNT > 0
+#if (TCP_HANDOFF_SIZE & (TCP_HANDOFF_SIZE - 1)) != 0
+#error "TCP_HANDOFF_SIZE must be a power of two"
+#endif
+
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+
+// NOTE: What a worker needs to know about a client, as the rest of its
+//       context is the same for all of them.
+typedef struct TcpHandoff {
+    TcpClient client;
+    void (*serve)(TcpContext*);
+} TcpHandoff;
+
+// NOTE: The main thread hands clients to a worker through `handoffs`, a
+//       single-producer single-consumer ring where only the main thread
+//       writes `tail` and only the worker writes `head`. The main thread
+//       only signals `fd` when it finds that the worker had taken everything
+//       before its push, and the worker looks at `tail` again after
+//       publishing its `head` before it waits, so one of them always sees
+//       the other.
+//
+//       `clients` are those dispatched to the worker that haven't
+//       disconnected yet. The main thread adds to it as it dispatches and
+//       the worker takes away, so a client counts from the moment it's
+//       picked and a burst doesn't all go to the same worker.
+typedef struct TcpWorker {
+    _Alignas(64) unsigned head;
+    _Alignas(64) unsigned tail;
+    _Alignas(64) int clients;
+
+    _Alignas(64) int stop;      // Set by tcp_close.
+    int          id;
+    int          listen_fd;     // With TCP_REUSEPORT.
+    int          fd[2];         // Read and write end, the same eventfd on Linux.
+    pthread_t    thread;
+    TcpServer    server;
+    TcpHandoff   handoffs[TCP_HANDOFF_SIZE];
+} TcpWorker;
+#endif
+
+#if TCP__DISPATCHES
+// NOTE: A worker can't have more clients than coroutines besides its own.
+#if TCP_MAX_CLIENTS < COROUTINE_MAX_COUNT
+#define TCP__WORKER_CAPACITY (TCP_MAX_CLIENTS)
+#else
+#define TCP__WORKER_CAPACITY (COROUTINE_MAX_COUNT - 1)
+#endif
+#endif
+
+
+// NOTE: Counts the client as gone from the worker it was dispatched to, which
+//       isn't where it ends if it was stolen.
+static void tcp__client_done(TcpContext* context) {
+#if TCP__DISPATCHES
+    __atomic_sub_fetch(&context->server.workers[context->worker].clients, 1, __ATOMIC_RELAXED);
+#else
+    (void) context;
+#endif
+}
+
+
+static void tcp__on_client_disconnected(void* data, size_t size) {
+    assert(size == sizeof(TcpContext));
+    TcpContext* context = data;
+    close(context->client.fd);
+    tcp__client_done(context);
+}
+
+
+// NOTE: Opens a non-blocking socket bound to `address`, which is updated with
+//       the port that was picked if it was 0. Returns the socket, or -errno.
+static int tcp__listen(struct sockaddr_in* address, uint16_t backlog, bool listening) {
+    int status;
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -errno;
+
+    const int enable = 1;
+    status = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    if (status < 0) goto error;
+
+#if defined(TCP_REUSEPORT)
+    status = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+    if (status < 0) goto error;
+#endif
+
+    status = bind(fd, (struct sockaddr*)address, sizeof(*address));
+    if (status < 0) goto error;
+
+    socklen_t address_size = sizeof(*address);
+    status = getsockname(fd, (struct sockaddr *)address, &address_size);
+    if (status < 0) goto error;
+
+    // NOTE: A backlog of 0 means the system's maximum. A small one drops the
+    //       handshakes of a burst of clients, which then retry after seconds.
+    if (listening) {
+        status = listen(fd, backlog ? backlog : SOMAXCONN);
+        if (status < 0) goto error;
+    }
+
+    status = fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    if (status < 0) goto error;
+
+    return fd;
+
+error:
+    status = errno;
+    close(fd);
+    return -status;
+}
+
+
+// NOTE: Accepts a client from the listening socket `fd`, and fails with
+//       EAGAIN if there's none waiting. Fails like tcp_accept otherwise.
+static TcpClient tcp__accept(int fd) {
+    struct sockaddr_in client_address = { 0 };
+    socklen_t client_address_size = sizeof(client_address);
+
+#if defined(__linux__) && defined(SOCK_NONBLOCK) && defined(_GNU_SOURCE)
+    // NOTE: Saves the two fcntl calls per client. glibc only declares accept4
+    //       when built with -D_GNU_SOURCE (see the Makefile).
+    int client_fd = accept4(fd, (struct sockaddr*) &client_address, &client_address_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_fd < 0) goto error;
+#else
+    int status;
+    int client_fd = accept(fd, (struct sockaddr*) &client_address, &client_address_size);
+    if (client_fd < 0) goto error;
 
-    TcpContext* context = (TcpContext*)top - 1;
-    TcpClient*  client  = &context->client;
+    status = fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL, 0) | O_NONBLOCK);
+    if (status < 0) goto error;
+#endif
+
+    coroutine_trace(CT_ACCEPT, coroutine_id(), client_fd);
+    return (TcpClient) { .fd = client_fd, .host = client_address.sin_addr.s_addr, .port = ntohs(client_address.sin_port) };
 
-    close(client->fd);
+error:;
+    int error = errno;
+    if (client_fd > 0) close(client_fd);
+    return (TcpClient) { .fd = -error };
+}
+
+
+// NOTE: Runs the context's handler for its client on this thread.
+static void tcp__serve(TcpContext* context) {
+    int id = coroutine_create_ex((void (*)(void *)) context->serve, context, sizeof(*context), tcp__on_client_disconnected, TCP__CLIENT_FLAGS);
+    if (id < 0) {
+        TCP_LOG(thread_id, coroutine_id(), "Out of coroutines, dropping client %d", context->client.fd);
+        close(context->client.fd);
+        tcp__client_done(context);
+    }
 }
 
 
+#if TCP__DISPATCHES
+static int tcp__worker_clients(TcpServer* server, int worker) {
+    return __atomic_load_n(&server->workers[worker].clients, __ATOMIC_RELAXED);
+}
+
+
+// NOTE: Returns the worker with the fewest clients, or -1 if all are full.
+static int tcp__least_loaded(TcpServer* server) {
+    int best = -1;
+    int best_clients = TCP__WORKER_CAPACITY;
+    for (int i = 0; i < server->thread_count; ++i) {
+        int clients = tcp__worker_clients(server, i);
+        if (clients < best_clients) {
+            best = i;
+            best_clients = clients;
+        }
+    }
+    return best;
+}
+
+
+// NOTE: Picks the worker for the next client (see TCP_DISPATCH), or returns
+//       -1 if all are full. The policy's pick falls back to the least loaded
+//       one if it's full.
+static int tcp__pick_worker(TcpServer* server) {
+#if TCP_DISPATCH == TCP_DISPATCH_ROUND_ROBIN
+    int worker = server->next_thread;
+    server->next_thread = (server->next_thread + 1) % server->thread_count;
+#elif TCP_DISPATCH == TCP_DISPATCH_LEAST_CLIENTS
+    int worker = tcp__least_loaded(server);
+#elif TCP_DISPATCH == TCP_DISPATCH_TWO_CHOICES
+    // NOTE: Comparing two random workers spreads almost as evenly as
+    //       scanning all of them, for two loads of shared counters.
+    server->random ^= server->random << 13;
+    server->random ^= server->random >> 17;
+    server->random ^= server->random << 5;
+
+    int count  = server->thread_count;
+    int worker = (int)((server->random & 0xFFFF) % count);
+    int other  = (int)((server->random >> 16) % count);
+    if (tcp__worker_clients(server, other) < tcp__worker_clients(server, worker))
+        worker = other;
+#else
+#error "TCP_DISPATCH must be TCP_DISPATCH_ROUND_ROBIN, TCP_DISPATCH_LEAST_CLIENTS or TCP_DISPATCH_TWO_CHOICES"
+#endif
+    if (worker < 0 || tcp__worker_clients(server, worker) < TCP__WORKER_CAPACITY)
+        return worker;
+    return tcp__least_loaded(server);
+}
+#endif
+
+
+#if defined(TCP_REUSEPORT)
+// NOTE: Accepts the clients of a worker's own listener, which is passed as
+//       the client of `arg`, and serves them on the worker. It only stops
+//       when the worker is torn down.
+static void tcp__acceptor(void* arg) {
+    TcpContext listener = *(TcpContext*) arg;
+    while (!tcp_shutdown_requested()) {
+        coroutine_wait_read(listener.client.fd);
+
+        for (int i = 0; i < TCP_ACCEPT_BATCH; ++i) {
+            TcpClient client = tcp__accept(listener.client.fd);
+            if (client.fd < 0) {
+                if (-client.fd != EAGAIN && -client.fd != EWOULDBLOCK) {
+                    TCP_LOG(thread_id, coroutine_id(), "Failed to accept: %s", tcp_client_error(client));
+                }
+                break;
+            }
+
+            TcpContext context = { client, listener.server, listener.serve };
+            tcp__serve(&context);
+        }
+    }
+}
+#endif
+
+
 #if TCP_THREAD_COUNT > 0
 static void tcp__shutdown_signal_handler(int sig) {
     assert(sig == SIGUSR1);
@@ -133,30 +451,80 @@ static void tcp__shutdown_signal_handler(int sig) {
 
     // NOTE: The server might be sleeping, so we use this to ensure it's
     //       set to active and can proceed with the shutdown.
-    coroutine_wake_up(0);
+    coroutine_wake_up_from_signal(0);
 }
 
 
-static void* tcp__worker_function(void* arg) {
-    int fd = (ssize_t)arg & 0xFFFFFFFF;
-    thread_id = (ssize_t)arg >> 32;
+static void tcp__worker_signal(TcpWorker* worker) {
+#if defined(__linux__)
+    uint64_t one = 1;
+    if (write(worker->fd[1], &one, sizeof(one)) < 0 && errno != EAGAIN)
+#else
+    char byte = 0;
+    if (write(worker->fd[1], &byte, 1) < 0 && errno != EAGAIN)
+#endif
+        perror("write");
+}
 
-    TcpContext context = { 0 };
-    while (true) {
-        coroutine_wait_read(fd);
 
-        // Woken up by explicit shutdown request
-        if (tcp_shutdown_requested())
-            goto terminate;
+// NOTE: Called by the main thread. Returns 0 if the ring is full.
+static int tcp__handoff_push(TcpWorker* worker, TcpHandoff handoff) {
+    unsigned tail = worker->tail;
+    if (tail - __atomic_load_n(&worker->head, __ATOMIC_ACQUIRE) == TCP_HANDOFF_SIZE)
+        return 0;
 
-        // TODO: Error handling
-        ssize_t bytes_read = read(fd, &context, sizeof(context));
+    worker->handoffs[tail & (TCP_HANDOFF_SIZE - 1)] = handoff;
+    __atomic_store_n(&worker->tail, tail + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&worker->head, __ATOMIC_SEQ_CST) == tail)
+        tcp__worker_signal(worker);
+    return 1;
+}
 
-        // Woken up by shutdown request from other threads.
-        if (bytes_read != sizeof(context))
-            goto terminate;
 
-        coroutine_create((void (*)(void *)) context.serve, &context, sizeof(context), tcp__on_client_disconnected);
+static void tcp__worker_take(TcpWorker* worker, TcpHandoff* handoff) {
+    TcpContext context = { handoff->client, worker->server, handoff->serve, worker->id - 1 };
+#if defined(TCP_REUSEPORT)
+    // NOTE: The only handoff is from tcp__start_acceptors, with the handler
+    //       to start accepting on our listener with.
+    context.client = (TcpClient) { .fd = worker->listen_fd };
+    if (coroutine_create(tcp__acceptor, &context, sizeof(context), NULL) < 0) {
+        TCP_LOG(thread_id, coroutine_id(), "Out of coroutines, not accepting on %d", worker->listen_fd);
+    }
+#else
+    tcp__serve(&context);
+#endif
+}
+
+
+// NOTE: Takes everything that's in the ring when woken up, and gives the
+//       clients a turn before looking again, so they aren't starved if the
+//       main thread keeps it full.
+static void* tcp__worker_function(void* arg) {
+    TcpWorker* worker = arg;
+    thread_id = worker->id;
+
+    while (true) {
+        coroutine_wait_read(worker->fd[0]);
+
+        char buffer[64];
+        while (read(worker->fd[0], buffer, sizeof(buffer)) > 0) {}
+
+        while (true) {
+            // Woken up by explicit shutdown request, or by tcp_close after
+            // a shutdown request from another thread.
+            if (tcp_shutdown_requested() || __atomic_load_n(&worker->stop, __ATOMIC_ACQUIRE))
+                goto terminate;
+
+            unsigned head = worker->head;
+            unsigned tail = __atomic_load_n(&worker->tail, __ATOMIC_SEQ_CST);
+            if (head == tail)
+                break;
+
+            for (; head != tail; ++head)
+                tcp__worker_take(worker, &worker->handoffs[head & (TCP_HANDOFF_SIZE - 1)]);
+            __atomic_store_n(&worker->head, head, __ATOMIC_SEQ_CST);
+            coroutine_yield();
+        }
     }
 
 terminate:
@@ -169,6 +537,71 @@ terminate:
     return NULL;
 }
 
+
+static void tcp__free_workers(TcpWorker* workers, int count) {
+    for (int i = 0; i < count; ++i) {
+        close(workers[i].fd[0]);
+        if (workers[i].fd[1] != workers[i].fd[0])
+            close(workers[i].fd[1]);
+        if (workers[i].listen_fd >= 0)
+            close(workers[i].listen_fd);
+    }
+    free(workers);
+}
+
+
+// NOTE: Sets up the workers' rings and fds, and with TCP_REUSEPORT their
+//       listeners, but doesn't start them. Returns NULL with errno set on
+//       failure.
+static TcpWorker* tcp__open_workers(int count, struct sockaddr_in* address, uint16_t backlog) {
+    TcpWorker* workers = aligned_alloc(_Alignof(TcpWorker), count * sizeof(*workers));
+    if (workers == NULL)
+        return NULL;
+    memset(workers, 0, count * sizeof(*workers));
+
+    for (int i = 0; i < count; ++i) {
+        TcpWorker* worker = &workers[i];
+        worker->id = i + 1;
+        worker->listen_fd = -1;
+        worker->fd[0] = worker->fd[1] = -1;
+
+#if defined(__linux__)
+        worker->fd[0] = worker->fd[1] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+        int status = worker->fd[0] < 0 ? -1 : 0;
+#else
+        int status = pipe(worker->fd);
+        for (int j = 0; status == 0 && j < 2; ++j) {
+            fcntl(worker->fd[j], F_SETFL, fcntl(worker->fd[j], F_GETFL, 0) | O_NONBLOCK);
+            fcntl(worker->fd[j], F_SETFD, FD_CLOEXEC);
+        }
+#endif
+
+#if defined(TCP_REUSEPORT)
+        // NOTE: All of them listen before any worker runs, so clients that
+        //       connect early wait in a backlog rather than being refused.
+        if (status == 0) {
+            worker->listen_fd = tcp__listen(address, backlog, true);
+            if (worker->listen_fd < 0) {
+                errno = -worker->listen_fd;
+                worker->listen_fd = -1;
+                status = -1;
+            }
+        }
+#else
+        (void) address;
+        (void) backlog;
+#endif
+
+        if (status != 0) {
+            int error = errno;
+            tcp__free_workers(workers, i + (worker->fd[0] >= 0));
+            errno = error;
+            return NULL;
+        }
+    }
+    return workers;
+}
+
 #if defined(__APPLE__)
 #include <sys/sysctl.h>
 int tcp__num_cores(int number_on_error) {
@@ -191,32 +624,21 @@ int tcp__num_cores(int number_on_error) {
 
 
 TcpServer tcp_server(const char* host, uint16_t port, uint16_t backlog) {
-    int status;
-
     struct sockaddr_in server_address;
     server_address.sin_family = AF_INET;
     server_address.sin_port = htons(port);
     server_address.sin_addr.s_addr = host ? inet_addr(host) : INADDR_ANY;
 
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) goto error;
-
-    const int enable = 1;
-    status = setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
-    if (status < 0) goto error;
-
-    status = bind(server_fd, (struct sockaddr*)&server_address, sizeof(server_address));
-    if (status < 0) goto error;
-
-    socklen_t server_address_size = sizeof(server_address);
-    status = getsockname(server_fd, (struct sockaddr *)&server_address, &server_address_size);
-    if (status < 0) goto error;
-
-    status = listen(server_fd, backlog);
-    if (status < 0) goto error;
-
-    status = fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL, 0) | O_NONBLOCK);
-    if (status < 0) goto error;
+#if defined(TCP_REUSEPORT)
+    // NOTE: Only holds on to the port, as a connection the kernel handed to a
+    //       socket that nobody accepts on would never be served. The workers
+    //       listen on their own sockets, bound to the same port.
+    int server_fd = tcp__listen(&server_address, backlog, false);
+#else
+    int server_fd = tcp__listen(&server_address, backlog, true);
+#endif
+    if (server_fd < 0)
+        return (TcpServer){ server_fd, server_address.sin_addr.s_addr, ntohs(server_address.sin_port), backlog };
 
     TcpServer result = {
         server_fd,
@@ -226,71 +648,168 @@ TcpServer tcp_server(const char* host, uint16_t port, uint16_t backlog) {
     };
 
 #if TCP_THREAD_COUNT > 0
-    g_main_thread = pthread_self();
-    signal(SIGUSR1, tcp__shutdown_signal_handler);
-
-    int write_fds[TCP_THREAD_COUNT] = { 0 };
-    pthread_t threads[TCP_THREAD_COUNT] = { 0 };
     result.thread_count = TCP__THREAD_COUNT;
-    for (ssize_t i = 0; i < result.thread_count; ++i) {
-        int pipe_fd[2];
-        pipe(pipe_fd);
+    result.random = 0x9E3779B9;
+    result.workers = tcp__open_workers(result.thread_count, &server_address, backlog);
+    if (result.workers == NULL) {
+        int status = errno;
+        close(server_fd);
+        return (TcpServer){ -status, result.host, result.port, backlog };
+    }
 
-        int read_fd  = pipe_fd[0];
-        int write_fd = pipe_fd[1];
+    g_main_thread = pthread_self();
+    signal(SIGUSR1, tcp__shutdown_signal_handler);
 
-        write_fds[i] = write_fd;
+    for (int i = 0; i < result.thread_count; ++i) {
+        result.workers[i].server = result;
+        pthread_create(&result.workers[i].thread, NULL, tcp__worker_function, &result.workers[i]);
+    }
+#endif
+    return result;
+}
 
-        pthread_t thread;
-        pthread_create(&thread, NULL, tcp__worker_function, (void *)((ssize_t)read_fd | ((i+1) << 32)));
 
-        threads[i] = thread;
+#if defined(TCP_REUSEPORT)
+// NOTE: Hands every worker the handler to accept on its listener with, once.
+//       Returns 0 if a shutdown was requested before they all had it.
+static int tcp__start_acceptors(TcpServer* server, void (*serve)(TcpContext*)) {
+    TcpHandoff handoff = { { 0 }, serve };
+    for (; server->accepting < server->thread_count; ++server->accepting) {
+        while (!tcp__handoff_push(&server->workers[server->accepting], handoff)) {
+            if (tcp_shutdown_requested())
+                return 0;
+            sched_yield();
+        }
+    }
+    return 1;
+}
+#else
+// NOTE: Hands the client to a worker, or serves it on this thread without
+//       them. Fails with EAGAIN if all workers are full.
+static TcpClient tcp__dispatch(TcpServer* server, TcpClient client, void (*serve)(TcpContext*)) {
+#if TCP__DISPATCHES
+    int worker = tcp__pick_worker(server);
+    if (worker < 0) {
+        TCP_LOG(thread_id, coroutine_id(), "All workers are full, dropping client %d", client.fd);
+        close(client.fd);
+        return (TcpClient) { .fd = -EAGAIN };
     }
 
-    memcpy(result.thread_fds, write_fds, result.thread_count * sizeof(*write_fds));
-    memcpy(result.threads, threads, result.thread_count * sizeof(*threads));
+    __atomic_add_fetch(&server->workers[worker].clients, 1, __ATOMIC_RELAXED);
+    coroutine_trace(CT_DISPATCH, worker + 1, client.fd);
+
+    // NOTE: A full ring means the worker is behind, so we give up the core
+    //       until it has taken some, which it might need if it's the same.
+    //       A worker that has stopped never will.
+    TcpHandoff handoff = { client, serve };
+    while (!tcp__handoff_push(&server->workers[worker], handoff)) {
+        if (tcp_shutdown_requested()) {
+            __atomic_sub_fetch(&server->workers[worker].clients, 1, __ATOMIC_RELAXED);
+            close(client.fd);
+            return (TcpClient) { .fd = -ECONNABORTED };
+        }
+        sched_yield();
+    }
+#else
+    TcpContext context = { client, *server, serve };
+    tcp__serve(&context);
 #endif
-    return result;
-
-error:
-    status = errno;
-    if (server_fd > 0) close(server_fd);
-    return (TcpServer){ -status, server_address.sin_addr.s_addr, ntohs(server_address.sin_port), backlog };
+    return client;
 }
+#endif
 
 
 TcpClient tcp_accept(TcpServer* server, void (*serve)(TcpContext*)) {
-    int status;
+    TcpClient client = { 0 };
+    tcp_accept_batch(server, serve, &client, 1);
+    return client;
+}
+
 
-    coroutine_wait_read(server->fd);
-    if (tcp_shutdown_requested()) {
-        return (TcpClient) { 0 };
+// NOTE: Waits for the listener once and accepts the clients that are queued
+//       on it, up to `count`, so a burst of them costs one wakeup and one
+//       accept each. Every client is served like with tcp_accept, which
+//       would have returned what's put in `clients`. Returns how many were
+//       put there, which is 0 only if a shutdown was requested.
+int tcp_accept_batch(TcpServer* server, void (*serve)(TcpContext*), TcpClient* clients, int count) {
+#if defined(TCP_REUSEPORT)
+    // NOTE: The workers accept their own clients, so this only starts their
+    //       acceptors and returns once a shutdown has been requested. It sleeps
+    //       rather than parks, so the scheduler has a timer to block on until
+    //       the shutdown signal wakes it up.
+    (void) clients;
+    (void) count;
+
+    if (!tcp__start_acceptors(server, serve))
+        return 0;
+    while (!tcp_shutdown_requested())
+        coroutine_sleep_ms(1000);
+    return 0;
+#else
+    int accepted = 0;
+    while (accepted == 0) {
+        coroutine_wait_read(server->fd);
+        if (tcp_shutdown_requested())
+            return 0;
+
+        while (accepted < count) {
+            TcpClient client = tcp__accept(server->fd);
+            if (client.fd == -EAGAIN || client.fd == -EWOULDBLOCK)
+                break;
+
+            // NOTE: Stop at an error, so one that persists (e.g. out of fds)
+            //       is reported once per wakeup rather than spun on.
+            if (client.fd < 0) {
+                clients[accepted++] = client;
+                break;
+            }
+            clients[accepted++] = tcp__dispatch(server, client, serve);
+        }
     }
+    return accepted;
+#endif
+}
 
-    struct sockaddr_in client_address = { 0 };
-    socklen_t client_address_size = sizeof(client_address);
 
-    int client_fd = accept(server->fd, (struct sockaddr*) &client_address, &client_address_size);
+// NOTE: The socket is non-blocking before connecting, so the coroutine waits
+//       for the handshake by waiting for it to become writable, and the rest
+//       of the scheduler keeps running. Fails like tcp_accept, and with
+//       ETIMEDOUT if `timeout_ms` (unless negative) passes first. A NULL
+//       `host` is the loopback address.
+TcpClient tcp_connect(const char* host, uint16_t port, int timeout_ms) {
+    int status;
+
+    struct sockaddr_in server_address = { 0 };
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(port);
+    server_address.sin_addr.s_addr = host ? inet_addr(host) : htonl(INADDR_LOOPBACK);
+
+    int client_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (client_fd < 0) goto error;
 
     status = fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL, 0) | O_NONBLOCK);
     if (status < 0) goto error;
 
-    TcpClient client = { .fd = client_fd, .host = client_address.sin_addr.s_addr, .port = ntohs(client_address.sin_port) };
+    status = connect(client_fd, (struct sockaddr*) &server_address, sizeof(server_address));
+    if (status < 0 && errno != EINPROGRESS) goto error;
 
-#if TCP_THREAD_COUNT > 0
-    TcpContext context = { client, *server, serve };
-
-    int thread_fd = server->thread_fds[server->next_thread];
-    server->next_thread = (server->next_thread + 1) % server->thread_count;
+    if (status < 0) {
+        if (!coroutine_wait_write_timeout(client_fd, timeout_ms)) {
+            errno = ETIMEDOUT;
+            goto error;
+        }
 
-    write(thread_fd, &context, sizeof(context));
-#else
-    TcpContext context = { client, *server, serve };
-    coroutine_create((void (*)(void *)) context.serve, &context, sizeof(context), tcp__on_client_disconnected);
-#endif
+        int result = 0;
+        socklen_t result_size = sizeof(result);
+        status = getsockopt(client_fd, SOL_SOCKET, SO_ERROR, &result, &result_size);
+        if (status < 0) goto error;
+        if (result != 0) {
+            errno = result;
+            goto error;
+        }
+    }
 
-    return client;
+    return (TcpClient) { .fd = client_fd, .host = server_address.sin_addr.s_addr, .port = port };
 
 error:
     status = errno;
@@ -299,24 +818,79 @@ error:
 }
 
 
+// NOTE: Client sockets are non-blocking, so the read or write is tried first
+//       and the coroutine only waits if it fails with EAGAIN, which saves a
+//       switch and a poll when the data or buffer space is already there.
+//       A wait that times out fails with ETIMEDOUT, and each wait gets the
+//       full `timeout_ms` if a wake-up turns out to be spurious.
+static ssize_t tcp__transfer(int fd, char* buffer, size_t bytes, CoroutineMode mode, int timeout_ms) {
+    while (true) {
+        ssize_t result = (mode == CM_WAIT_READ) ? read(fd, buffer, bytes) : write(fd, buffer, bytes);
+        if (result >= 0)
+            return result;
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+
+#if defined(COROUTINE_IO_URING) && !defined(COROUTINE_SHARED_STACK)
+        // NOTE: The ring does the wait and the transfer as one operation.
+        if (timeout_ms < 0)
+            return (mode == CM_WAIT_READ) ? coroutine_read(fd, buffer, bytes) : coroutine_write(fd, buffer, bytes);
+#endif
+        if (timeout_ms < 0) {
+            coroutine_switch(fd, mode);
+        } else if (!coroutine_wait_timeout(fd, mode, timeout_ms)) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+}
+
+
 ssize_t tcp_read(TcpClient* client, char* buffer, size_t bytes) {
-    coroutine_wait_read(client->fd);
-    return read(client->fd, buffer, bytes);
+    return tcp__transfer(client->fd, buffer, bytes, CM_WAIT_READ, -1);
 }
 
 
 ssize_t tcp_write(TcpClient* client, char* buffer, size_t bytes) {
-    coroutine_wait_write(client->fd);
-    return write(client->fd, buffer, bytes);
+    return tcp__transfer(client->fd, buffer, bytes, CM_WAIT_WRITE, -1);
 }
 
 
+// NOTE: Fails with errno set to ETIMEDOUT if the client isn't ready in time.
+ssize_t tcp_read_timeout(TcpClient* client, char* buffer, size_t bytes, int timeout_ms) {
+    return tcp__transfer(client->fd, buffer, bytes, CM_WAIT_READ, timeout_ms);
+}
+
+
+ssize_t tcp_write_timeout(TcpClient* client, char* buffer, size_t bytes, int timeout_ms) {
+    return tcp__transfer(client->fd, buffer, bytes, CM_WAIT_WRITE, timeout_ms);
+}
+
+
+#if defined(TCP_STACK_PROFILE)
+static void tcp__print_stack_profile(void) {
+    CoroutineStackProfile profiles[COROUTINE_STACK_PROFILE_ENTRIES];
+    int count = coroutine_stack_profile(profiles, COROUTINE_STACK_PROFILE_ENTRIES);
+    for (int i = 0; i < count && i < COROUTINE_STACK_PROFILE_ENTRIES; ++i) {
+        fprintf(stderr, "stack profile: entry=%p clients=%llu max_bytes=%llu stack_bytes=%d",
+                (void*) profiles[i].entry, profiles[i].count, profiles[i].max, (int) COROUTINE_STACK_SIZE);
+        for (int j = 0; j < COROUTINE_STACK_PROFILE_BUCKETS; ++j) {
+            if (profiles[i].buckets[j] != 0)
+                fprintf(stderr, " le_%d=%llu", 256 << j, profiles[i].buckets[j]);
+        }
+        fprintf(stderr, "\n");
+    }
+}
+#endif
+
+
 void tcp_close(TcpServer* server) {
 #if TCP_THREAD_COUNT > 0
     for (int i = 0; i < server->thread_count; ++i) {
-        int thread_fd = server->thread_fds[server->next_thread];
-        server->next_thread = (server->next_thread + 1) % server->thread_count;
-        write(thread_fd, &i, sizeof(i));
+        __atomic_store_n(&server->workers[i].stop, 1, __ATOMIC_SEQ_CST);
+        tcp__worker_signal(&server->workers[i]);
     }
 #endif
 
@@ -324,11 +898,24 @@ void tcp_close(TcpServer* server) {
 
 #if TCP_THREAD_COUNT > 0
     for (int i = 0; i < server->thread_count; ++i) {
-        if (pthread_join(server->threads[i], NULL) != 0) {
+        if (pthread_join(server->workers[i].thread, NULL) != 0) {
             perror("pthread_join");
         }
         TCP_LOG(thread_id, coroutine_id(), "Thread %d joined!", i+1);
     }
+    tcp__free_workers(server->workers, server->thread_count);
+#endif
+
+#if defined(TCP_TRACE)
+    int trace_fd = open(TCP_TRACE_FILE, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if (trace_fd < 0 || coroutine_trace_dump(trace_fd) < 0)
+        perror("coroutine_trace_dump");
+    if (trace_fd >= 0)
+        close(trace_fd);
+#endif
+
+#if defined(TCP_STACK_PROFILE)
+    tcp__print_stack_profile();
 #endif
 
     TCP_LOG(thread_id, coroutine_id(), "Terminating server%s", "");
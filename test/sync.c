@@ -0,0 +1,751 @@
+// Tests for the channels, synchronization primitives, futures, joins and
+// scheduler handles, on one thread and between threads (see `make test`).
+// Each test prints one line and the first failed check exits with 1.
+//
+//     cc test/sync.c [-DCOROUTINE_POLL_EPOLL | -DCOROUTINE_IO_URING] [-DCOROUTINE_SHARED_STACK]
+#define COROUTINE_IS_THREADED 1
+#define COROUTINE_STACK_MMAP
+#define COROUTINE_IMPLEMENTATION
+#include "../coroutine.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(COROUTINE_IO_URING)
+#define TEST_BACKEND "io_uring"
+#elif defined(COROUTINE_POLL_EPOLL)
+#define TEST_BACKEND "epoll"
+#else
+#define TEST_BACKEND "poll"
+#endif
+
+#if defined(COROUTINE_SHARED_STACK)
+#define TEST_STACK "shared"
+#else
+#define TEST_STACK "mmap"
+#endif
+
+#define CHECK(x) do {                                                           \
+    if (!(x)) {                                                                 \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x);   \
+        exit(1);                                                                \
+    }                                                                           \
+} while (0)
+
+// NOTE: A deadlock would otherwise hang the build.
+#define TEST_TIMEOUT_S 30
+
+#define MESSAGES 20000
+
+
+static void test_pass(const char* name) {
+    printf("test=%s backend=%s stack=%s ok\n", name, TEST_BACKEND, TEST_STACK);
+}
+
+
+// NOTE: Waits for coroutines by joining them, as one that's been taken off a
+//       wait queue by another thread might not be runnable yet.
+#define MAX_SPAWNED 16
+
+typedef struct Spawned {
+    int ids[MAX_SPAWNED];
+    int count;
+} Spawned;
+
+
+static void spawn_ex(Spawned* spawned, void (*entry)(void*), const void* data, size_t size, int flags) {
+    CHECK(spawned->count < MAX_SPAWNED);
+    int id = coroutine_create_ex(entry, data, size, NULL, flags);
+    CHECK(id > 0);
+    spawned->ids[spawned->count++] = id;
+}
+
+
+static void spawn(Spawned* spawned, void (*entry)(void*), void* arg) {
+    spawn_ex(spawned, entry, &arg, sizeof(arg), CF_NONE);
+}
+
+
+static void join_all(Spawned* spawned) {
+    for (int i = 0; i < spawned->count; ++i)
+        CHECK(coroutine_join(spawned->ids[i]) == 0);
+    spawned->count = 0;
+}
+
+
+typedef struct Stream {
+    CoroutineChannel*  channel;
+    CoroutineWaitGroup done;
+    int                count;
+    long long          sum;
+} Stream;
+
+
+static void send_range(void* arg) {
+    Stream* stream = *(Stream**)arg;
+    for (int i = 0; i < stream->count; ++i)
+        CHECK(coroutine_channel_send(stream->channel, &i) == 1);
+    coroutine_wait_group_done(&stream->done);
+}
+
+
+static void recv_all(void* arg) {
+    Stream* stream = *(Stream**)arg;
+    int value;
+    while (coroutine_channel_recv(stream->channel, &value) == 1)
+        stream->sum += value;
+}
+
+
+static void test_channel_same_thread(void) {
+    Stream stream = { coroutine_channel_create(sizeof(int), 4), { 0 }, MESSAGES, 0 };
+    Spawned spawned = { 0 };
+    coroutine_wait_group_add(&stream.done, 1);
+    spawn(&spawned, recv_all, &stream);
+    spawn(&spawned, send_range, &stream);
+
+    coroutine_wait_group_wait(&stream.done);
+    coroutine_channel_close(stream.channel);
+    join_all(&spawned);
+
+    int value = 0;
+    CHECK(stream.sum == (long long)MESSAGES * (MESSAGES - 1) / 2);
+    CHECK(coroutine_channel_send(stream.channel, &value) == -1);
+    CHECK(coroutine_channel_try_recv(stream.channel, &value) == -1);
+    coroutine_channel_destroy(stream.channel);
+    test_pass("channel_same_thread");
+}
+
+
+static void* send_range_thread(void* arg) {
+    Spawned spawned = { 0 };
+    spawn(&spawned, send_range, arg);
+    join_all(&spawned);
+    return NULL;
+}
+
+
+// NOTE: Two threads send to consumers on this one, and wake up the coroutine
+//       waiting on the group when they're done.
+static void test_channel_cross_thread(void) {
+    Stream stream = { coroutine_channel_create(sizeof(int), 4), { 0 }, MESSAGES, 0 };
+    Spawned spawned = { 0 };
+    coroutine_wait_group_add(&stream.done, 2);
+    spawn(&spawned, recv_all, &stream);
+    spawn(&spawned, recv_all, &stream);
+
+    pthread_t threads[2];
+    for (int i = 0; i < 2; ++i)
+        CHECK(pthread_create(&threads[i], NULL, send_range_thread, &stream) == 0);
+
+    coroutine_wait_group_wait(&stream.done);
+    coroutine_channel_close(stream.channel);
+    join_all(&spawned);
+    for (int i = 0; i < 2; ++i)
+        pthread_join(threads[i], NULL);
+
+    CHECK(stream.sum == 2 * ((long long)MESSAGES * (MESSAGES - 1) / 2));
+    coroutine_channel_destroy(stream.channel);
+    test_pass("channel_cross_thread");
+}
+
+
+typedef struct Shared {
+    CoroutineMutex     mutex;
+    CoroutineCond      cond;
+    CoroutineWaitGroup done;
+    int                counter;
+    int                inside;
+    int                stage;
+    int                at_stage;
+} Shared;
+
+#define WORKERS    4
+#define INCREMENTS 1000
+
+
+// NOTE: Yields with the mutex held, so the others pile up on it.
+static void increment(void* arg) {
+    Shared* shared = *(Shared**)arg;
+    for (int i = 0; i < INCREMENTS; ++i) {
+        coroutine_mutex_lock(&shared->mutex);
+        CHECK(shared->inside++ == 0);
+        int counter = shared->counter;
+        coroutine_yield();
+        shared->counter = counter + 1;
+        shared->inside -= 1;
+        coroutine_mutex_unlock(&shared->mutex);
+    }
+    coroutine_wait_group_done(&shared->done);
+}
+
+
+// NOTE: Waits for each stage in turn, and says when it's seen it.
+static void follow_stages(void* arg) {
+    Shared* shared = *(Shared**)arg;
+    for (int stage = 1; stage <= 3; ++stage) {
+        coroutine_mutex_lock(&shared->mutex);
+        while (shared->stage < stage)
+            coroutine_cond_wait(&shared->cond, &shared->mutex);
+        shared->at_stage += 1;
+        coroutine_cond_broadcast(&shared->cond);
+        coroutine_mutex_unlock(&shared->mutex);
+    }
+    coroutine_wait_group_done(&shared->done);
+}
+
+
+static void* run_thread(void* arg) {
+    void (*entry)(void*) = ((void**)arg)[0];
+    Spawned spawned = { 0 };
+    for (int i = 0; i < WORKERS; ++i)
+        spawn(&spawned, entry, ((void**)arg)[1]);
+    join_all(&spawned);
+    return NULL;
+}
+
+
+// NOTE: Runs WORKERS coroutines on this thread and as many on another, and
+//       waits for the group before joining ours to test it across threads.
+static void run_on_two_threads(void (*entry)(void*), Shared* shared, Spawned* spawned) {
+    void* arg[2] = { (void*)entry, shared };
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, run_thread, arg) == 0);
+    for (int i = 0; i < WORKERS; ++i)
+        spawn(spawned, entry, shared);
+    coroutine_wait_group_wait(&shared->done);
+    join_all(spawned);
+    pthread_join(thread, NULL);
+}
+
+
+static void test_mutex(void) {
+    Shared shared = { 0 };
+    Spawned spawned = { 0 };
+    coroutine_wait_group_add(&shared.done, 2 * WORKERS);
+    run_on_two_threads(increment, &shared, &spawned);
+    CHECK(shared.counter == 2 * WORKERS * INCREMENTS);
+    CHECK(!shared.mutex.locked && shared.mutex.waiters.count == 0);
+    test_pass("mutex");
+}
+
+
+static void advance_stages(void* arg) {
+    Shared* shared = *(Shared**)arg;
+    for (int stage = 1; stage <= 3; ++stage) {
+        coroutine_mutex_lock(&shared->mutex);
+        shared->stage = stage;
+        coroutine_cond_broadcast(&shared->cond);
+        while (shared->at_stage < stage * 2 * WORKERS)
+            coroutine_cond_wait(&shared->cond, &shared->mutex);
+        coroutine_mutex_unlock(&shared->mutex);
+    }
+}
+
+
+static void test_cond(void) {
+    Shared shared = { 0 };
+    Spawned spawned = { 0 };
+    coroutine_wait_group_add(&shared.done, 2 * WORKERS);
+    spawn(&spawned, advance_stages, &shared);
+    run_on_two_threads(follow_stages, &shared, &spawned);
+    CHECK(shared.at_stage == 3 * 2 * WORKERS);
+    test_pass("cond");
+}
+
+
+typedef struct Limited {
+    CoroutineSemaphore semaphore;
+    int inside;
+    int peak;
+} Limited;
+
+
+static void use_permit(void* arg) {
+    Limited* limited = *(Limited**)arg;
+    for (int i = 0; i < 100; ++i) {
+        coroutine_semaphore_acquire(&limited->semaphore);
+        limited->inside += 1;
+        if (limited->inside > limited->peak)
+            limited->peak = limited->inside;
+        coroutine_yield();
+        limited->inside -= 1;
+        coroutine_semaphore_release(&limited->semaphore);
+    }
+}
+
+
+static void test_semaphore(void) {
+    Limited limited = { 0 };
+    Spawned spawned = { 0 };
+    coroutine_semaphore_init(&limited.semaphore, 2);
+    for (int i = 0; i < 8; ++i)
+        spawn(&spawned, use_permit, &limited);
+    join_all(&spawned);
+    CHECK(limited.peak == 2);
+    CHECK(coroutine_semaphore_try_acquire(&limited.semaphore));
+    CHECK(coroutine_semaphore_try_acquire(&limited.semaphore));
+    CHECK(!coroutine_semaphore_try_acquire(&limited.semaphore));
+    test_pass("semaphore");
+}
+
+
+static void* set_future(void* arg) {
+    usleep(10000);
+    coroutine_future_set(arg, (void*)(size_t)42);
+    return NULL;
+}
+
+
+static void get_future(void* arg) {
+    CoroutineFuture* future = *(CoroutineFuture**)arg;
+    CHECK(coroutine_future_get(future) == (void*)(size_t)42);
+}
+
+
+static void test_future(void) {
+    CoroutineFuture future = { 0 };
+    Spawned spawned = { 0 };
+    for (int i = 0; i < 4; ++i)
+        spawn(&spawned, get_future, &future);
+
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, set_future, &future) == 0);
+    join_all(&spawned);
+    pthread_join(thread, NULL);
+
+    CHECK(coroutine_future_ready(&future));
+    CHECK(coroutine_future_get(&future) == (void*)(size_t)42);
+    test_pass("future");
+}
+
+
+static void sleep_then_count(void* arg) {
+    int* finished = *(int**)arg;
+    coroutine_sleep_ms(20);
+    *finished += 1;
+}
+
+
+// NOTE: A finished coroutine's id must not refer to the one that reuses its
+//       slot, so joining it returns right away.
+static void test_join(void) {
+    int finished = 0;
+    Spawned spawned = { 0 };
+    spawn(&spawned, sleep_then_count, &finished);
+    int old_id = spawned.ids[0];
+    CHECK(coroutine_join(old_id) == 0);
+    CHECK(finished == 1);
+
+    spawn(&spawned, sleep_then_count, &finished);
+    int new_id = spawned.ids[1];
+    CHECK(new_id != old_id);
+    CHECK(coroutine_join(old_id) == 0);
+    CHECK(finished == 1);
+    CHECK(coroutine_join(coroutine_id()) == -1);
+    CHECK(coroutine_join(new_id) == 0);
+    CHECK(finished == 2);
+    test_pass("join");
+}
+
+
+// NOTE: A coroutine of another scheduler only runs once it's entered, and
+//       can be woken up from this one.
+static void test_scheduler(void) {
+    CoroutineFuture future = { 0 };
+    Spawned spawned = { 0 };
+    CoroutineScheduler* scheduler = coroutine_scheduler_create();
+    CHECK(scheduler != NULL);
+
+    CoroutineScheduler* previous = coroutine_scheduler_enter(scheduler);
+    CHECK(coroutine_scheduler_current() == scheduler);
+    spawn(&spawned, get_future, &future);
+    coroutine_yield();
+    CHECK(coroutine_active() == 1);
+    CHECK(coroutine_scheduler_enter(previous) == scheduler);
+
+    coroutine_future_set(&future, (void*)(size_t)42);
+
+    coroutine_scheduler_enter(scheduler);
+    join_all(&spawned);
+    CHECK(coroutine_active() == 1);
+    coroutine_scheduler_enter(previous);
+    coroutine_scheduler_destroy(scheduler);
+    test_pass("scheduler");
+}
+
+
+typedef struct SameFd {
+    int fd;
+    int read_done;
+    int write_done;
+    int readable;
+} SameFd;
+
+
+static void wait_then_read(void* arg) {
+    SameFd* same = *(SameFd**)arg;
+    char byte;
+    coroutine_wait_read(same->fd);
+    CHECK(read(same->fd, &byte, 1) == 1);
+    same->read_done = 1;
+}
+
+
+static void wait_readable(void* arg) {
+    SameFd* same = *(SameFd**)arg;
+    coroutine_wait_read(same->fd);
+    same->readable += 1;
+}
+
+
+static void wait_then_write(void* arg) {
+    SameFd* same = *(SameFd**)arg;
+    coroutine_wait_write(same->fd);
+    same->write_done = 1;
+}
+
+
+// NOTE: A reader and a writer waiting on the same fd are woken up
+//       independently, each when its own direction becomes ready, and all
+//       the waiters on the same direction are woken up together (and only
+//       then, rather than spinning).
+static void test_same_fd_waiters(void) {
+    int fds[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    CHECK(fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0);
+    CHECK(fcntl(fds[1], F_SETFL, O_NONBLOCK) == 0);
+
+    char buffer[4096] = { 0 };
+    while (write(fds[0], buffer, sizeof(buffer)) > 0)
+        ;
+
+    SameFd same = { fds[0], 0, 0, 0 };
+    Spawned spawned = { 0 };
+    spawn(&spawned, wait_then_read, &same);
+    spawn(&spawned, wait_then_write, &same);
+    coroutine_yield();
+
+    CHECK(write(fds[1], buffer, 1) == 1);
+    while (!same.read_done)
+        coroutine_yield();
+    CHECK(!same.write_done);
+
+    while (read(fds[1], buffer, sizeof(buffer)) > 0)
+        ;
+    join_all(&spawned);
+    CHECK(same.write_done);
+
+    spawn(&spawned, wait_readable, &same);
+    spawn(&spawned, wait_readable, &same);
+    coroutine_sleep_ms(20);
+    CHECK(same.readable == 0);
+
+    CHECK(write(fds[1], buffer, 1) == 1);
+    join_all(&spawned);
+    CHECK(same.readable == 2);
+    CHECK(read(fds[0], buffer, sizeof(buffer)) == 1);
+
+    close(fds[0]);
+    close(fds[1]);
+    test_pass("same_fd_waiters");
+}
+
+
+static double seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+
+typedef struct Timed {
+    int    fd;
+    int    timeout_ms;
+    int    ready;
+    double waited;
+} Timed;
+
+
+static void wait_read_timed(void* arg) {
+    Timed* timed = *(Timed**)arg;
+    double start = seconds();
+    timed->ready  = coroutine_wait_read_timeout(timed->fd, timed->timeout_ms);
+    timed->waited = seconds() - start;
+}
+
+
+typedef struct Wakes {
+    int order[2];
+    int count;
+} Wakes;
+
+
+static void sleep_30(void* arg) {
+    Wakes* wakes = *(Wakes**)arg;
+    coroutine_sleep_ms(30);
+    wakes->order[wakes->count++] = 30;
+}
+
+
+static void sleep_10(void* arg) {
+    Wakes* wakes = *(Wakes**)arg;
+    coroutine_sleep_ms(10);
+    wakes->order[wakes->count++] = 10;
+}
+
+
+// NOTE: A timed wait fails once it expires, succeeds as soon as the fd is
+//       ready or the coroutine is woken up before then, and timers fire in
+//       the order of their deadlines.
+static void test_timeouts(void) {
+    int fds[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    CHECK(fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0);
+
+    Timed expired = { fds[0], 20, -1, 0 };
+    Spawned spawned = { 0 };
+    spawn(&spawned, wait_read_timed, &expired);
+    join_all(&spawned);
+    CHECK(expired.ready == 0);
+    CHECK(expired.waited >= 0.019);
+
+    Timed readable = { fds[0], TEST_TIMEOUT_S * 1000, -1, 0 };
+    spawn(&spawned, wait_read_timed, &readable);
+    coroutine_yield();
+    CHECK(write(fds[1], "x", 1) == 1);
+    join_all(&spawned);
+    CHECK(readable.ready == 1);
+    CHECK(readable.waited < 1.0);
+
+    char byte;
+    CHECK(read(fds[0], &byte, 1) == 1);
+    Timed woken = { fds[0], TEST_TIMEOUT_S * 1000, -1, 0 };
+    spawn(&spawned, wait_read_timed, &woken);
+    coroutine_yield();
+    coroutine_wake_up(spawned.ids[0]);
+    join_all(&spawned);
+    CHECK(woken.ready == 1);
+    CHECK(woken.waited < 1.0);
+
+    Wakes wakes = { { 0 }, 0 };
+    spawn(&spawned, sleep_30, &wakes);
+    spawn(&spawned, sleep_10, &wakes);
+    join_all(&spawned);
+    CHECK(wakes.count == 2 && wakes.order[0] == 10 && wakes.order[1] == 30);
+
+    close(fds[0]);
+    close(fds[1]);
+    test_pass("timeouts");
+}
+
+
+typedef struct Order {
+    int turns[16];
+    int count;
+    int high_turns;
+    int low_seen;
+} Order;
+
+
+typedef struct Turn {
+    Order* order;
+    int    tag;
+} Turn;
+
+
+static void take_turns(void* arg) {
+    Turn turn = *(Turn*)arg;
+    for (int i = 0; i < 2; ++i) {
+        turn.order->turns[turn.order->count++] = turn.tag;
+        coroutine_yield();
+    }
+}
+
+
+static void yield_high(void* arg) {
+    Order* order = *(Order**)arg;
+    for (int i = 0; i < 4 * COROUTINE_PRIORITY_AGING; ++i) {
+        order->high_turns += 1;
+        coroutine_yield();
+    }
+}
+
+
+static void note_low(void* arg) {
+    Order* order = *(Order**)arg;
+    order->low_seen = order->high_turns;
+}
+
+
+// NOTE: Coroutines of a priority take turns in the order they were queued,
+//       higher priorities go first, and a lower one still gets a turn after
+//       being passed over COROUTINE_PRIORITY_AGING times.
+static void test_run_order(void) {
+    Order order = { { 0 }, 0, 0, 0 };
+    Spawned spawned = { 0 };
+    for (int i = 0; i < 3; ++i)
+        spawn_ex(&spawned, take_turns, &(Turn){ &order, i }, sizeof(Turn), CF_NONE);
+    join_all(&spawned);
+    int fifo[] = { 0, 1, 2, 0, 1, 2 };
+    CHECK(order.count == 6);
+    for (int i = 0; i < 6; ++i)
+        CHECK(order.turns[i] == fifo[i]);
+
+    order.count = 0;
+    spawn_ex(&spawned, take_turns, &(Turn){ &order, 2 }, sizeof(Turn), CF_PRIORITY_LOW);
+    spawn_ex(&spawned, take_turns, &(Turn){ &order, 1 }, sizeof(Turn), CF_NONE);
+    spawn_ex(&spawned, take_turns, &(Turn){ &order, 0 }, sizeof(Turn), CF_PRIORITY_HIGH);
+    join_all(&spawned);
+    int priorities[] = { 0, 0, 1, 1, 2, 2 };
+    CHECK(order.count == 6);
+    for (int i = 0; i < 6; ++i)
+        CHECK(order.turns[i] == priorities[i]);
+
+    spawn_ex(&spawned, yield_high, &(Order*){ &order }, sizeof(Order*), CF_PRIORITY_HIGH);
+    spawn_ex(&spawned, note_low, &(Order*){ &order }, sizeof(Order*), CF_PRIORITY_LOW);
+    join_all(&spawned);
+    CHECK(order.low_seen > 0 && order.low_seen <= COROUTINE_PRIORITY_AGING);
+    test_pass("run_order");
+}
+
+
+static int g_signal_target;
+
+static void wake_target(int sig) {
+    coroutine_wake_up_from_signal(g_signal_target);
+}
+
+
+static void sleep_long(void* arg) {
+    int* woken = *(int**)arg;
+    coroutine_sleep_ms(TEST_TIMEOUT_S * 1000);
+    *woken += 1;
+}
+
+
+// NOTE: A signal wakes up the coroutine it names, and once more are pending
+//       than are kept, every blocked coroutine is woken up.
+static void test_signal_wakes(void) {
+    int woken = 0;
+    Spawned spawned = { 0 };
+    for (int i = 0; i < 3; ++i)
+        spawn(&spawned, sleep_long, &woken);
+    coroutine_yield();
+
+    signal(SIGUSR1, wake_target);
+    g_signal_target = spawned.ids[0];
+    CHECK(raise(SIGUSR1) == 0);
+    CHECK(coroutine_join(spawned.ids[0]) == 0);
+    coroutine_sleep_ms(10);
+    CHECK(woken == 1);
+
+    double start = seconds();
+    for (int i = 0; i <= COROUTINE_SIGNAL_WAKES; ++i)
+        CHECK(raise(SIGUSR1) == 0);
+    join_all(&spawned);
+    CHECK(woken == 3);
+    CHECK(seconds() - start < 1.0);
+    signal(SIGUSR1, SIG_DFL);
+    test_pass("signal_wakes");
+}
+
+
+typedef struct Handoff {
+    int ids[2];
+    int turns;
+    int queued_seen;
+} Handoff;
+
+
+typedef struct Peer {
+    Handoff* handoff;
+    int      index;
+} Peer;
+
+
+static void record_turn(void* arg) {
+    Turn turn = *(Turn*)arg;
+    turn.order->turns[turn.order->count++] = turn.tag;
+}
+
+
+// NOTE: Hands over to its peer until both have had HANDOFF_ROUNDS turns,
+//       while the coroutine queued behind them waits.
+#define HANDOFF_ROUNDS 100
+
+static void hand_over(void* arg) {
+    Peer peer = *(Peer*)arg;
+    while (peer.handoff->turns < 2 * HANDOFF_ROUNDS) {
+        peer.handoff->turns += 1;
+        CHECK(coroutine_switch_to(peer.handoff->ids[1 - peer.index]) == 1);
+    }
+}
+
+
+static void note_queued(void* arg) {
+    Handoff* handoff = *(Handoff**)arg;
+    handoff->queued_seen = handoff->turns;
+}
+
+
+// NOTE: coroutine_switch_to runs its target right away, ahead of the ones
+//       queued before it, and returns 0 for a target that can't run.
+static void test_switch_to(void) {
+    Order order = { { 0 }, 0, 0, 0 };
+    Spawned spawned = { 0 };
+    for (int i = 0; i < 3; ++i)
+        spawn_ex(&spawned, record_turn, &(Turn){ &order, i }, sizeof(Turn), CF_NONE);
+    CHECK(coroutine_switch_to(spawned.ids[2]) == 1);
+    CHECK(order.count >= 1 && order.turns[0] == 2);
+    join_all(&spawned);
+    CHECK(order.count == 3 && order.turns[1] == 0 && order.turns[2] == 1);
+
+    CHECK(coroutine_switch_to(coroutine_id()) == 0);
+    CHECK(coroutine_switch_to(spawned.ids[0]) == 0);
+    int woken = 0;
+    spawn(&spawned, sleep_long, &woken);
+    coroutine_yield();
+    CHECK(coroutine_switch_to(spawned.ids[0]) == 0);
+    coroutine_wake_up(spawned.ids[0]);
+    join_all(&spawned);
+    CHECK(woken == 1);
+
+    Handoff handoff = { { 0 }, 0, -1 };
+    spawn_ex(&spawned, hand_over, &(Peer){ &handoff, 0 }, sizeof(Peer), CF_NONE);
+    spawn(&spawned, note_queued, &handoff);
+    spawn_ex(&spawned, hand_over, &(Peer){ &handoff, 1 }, sizeof(Peer), CF_NONE);
+    handoff.ids[0] = spawned.ids[0];
+    handoff.ids[1] = spawned.ids[2];
+    CHECK(coroutine_switch_to(handoff.ids[1]) == 1);
+    join_all(&spawned);
+    CHECK(handoff.turns == 2 * HANDOFF_ROUNDS);
+    CHECK(handoff.queued_seen == 2 * HANDOFF_ROUNDS);
+    test_pass("switch_to");
+}
+
+
+int main(void) {
+    alarm(TEST_TIMEOUT_S);
+
+    test_channel_same_thread();
+    test_channel_cross_thread();
+    test_mutex();
+    test_cond();
+    test_semaphore();
+    test_future();
+    test_join();
+    test_scheduler();
+    test_same_fd_waiters();
+    test_signal_wakes();
+    test_timeouts();
+    test_run_order();
+    test_switch_to();
+    return 0;
+}
@@ -0,0 +1,409 @@
+// Load generator for request/response servers like the example in main.c,
+// built on the same runtime. Each connection is a coroutine that sends a
+// payload and reads the whole response before the next request:
+//
+//     build/loadgen -c 100 -d 10            # closed loop, as fast as it goes
+//     build/loadgen -c 100 -d 10 -r 20000   # open loop, 20k requests/s
+//
+// In the closed loop, latency is the time from sending a request to having
+// its response. In the open loop, requests are scheduled at a fixed rate per
+// connection, and latency is counted from when a request *should* have been
+// sent, so a server that falls behind can't hide it by slowing down the
+// generator (coordinated omission).
+//
+// Responses are assumed to have the same size for a given payload. Unless
+// it's passed with -R, it's learnt from a first request. The result is one
+// line of `key=value` pairs, like the benchmarks in bench/.
+#define TCP_IMPLEMENTATION
+#include "../tcp.h"
+
+#include <getopt.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#define CONNECT_TIMEOUT_MS 5000
+#define REQUEST_TIMEOUT_MS 5000
+#define CALIBRATE_QUIET_MS 200
+
+// NOTE: An HDR-style histogram of nanoseconds. Values below 2^SUB_BITS are
+//       counted exactly, and every power of two above is split into
+//       2^SUB_BITS buckets, so a bucket is within 1/128 of the values in it.
+#define HISTOGRAM_SUB_BITS  7
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS  40
+#define HISTOGRAM_BUCKETS   ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+typedef struct Histogram {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} Histogram;
+
+
+typedef struct Options {
+    const char* address;
+    uint16_t    port;
+    int         connections;
+    int         threads;
+    double      seconds;
+    double      rate;           // Requests per second over all connections, 0 for a closed loop.
+    size_t      payload_size;
+    size_t      response_size;  // 0 until learnt.
+    int         shutdown;       // Send "shutdown" to the server when done.
+} Options;
+
+typedef struct Worker {
+    pthread_t thread;
+    int       first;            // Index of the worker's first connection.
+    int       count;
+    uint64_t  requests;
+    uint64_t  errors;
+    Histogram latency;
+} Worker;
+
+typedef struct Connection {
+    Worker* worker;
+    int     index;
+} Connection;
+
+
+static Options g_options = {
+    .address      = "127.0.0.1",
+    .port         = 6969,
+    .connections  = 100,
+    .threads      = 1,
+    .seconds      = 10,
+    .payload_size = 64,
+};
+
+static char*    g_payload;
+static uint64_t g_start;
+static uint64_t g_end;
+
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+
+static int histogram_index(uint64_t value) {
+    if (value < HISTOGRAM_SUB_COUNT)
+        return (int) value;
+    if (value >= (1ull << HISTOGRAM_MAX_BITS))
+        value = (1ull << HISTOGRAM_MAX_BITS) - 1;
+
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    return (shift + 1) * HISTOGRAM_SUB_COUNT + (int)(value >> shift) - HISTOGRAM_SUB_COUNT;
+}
+
+// NOTE: The highest value that's counted in the bucket.
+static uint64_t histogram_value(int index) {
+    if (index < HISTOGRAM_SUB_COUNT)
+        return (uint64_t) index;
+
+    int shift = index / HISTOGRAM_SUB_COUNT - 1;
+    uint64_t sub = (uint64_t)(index % HISTOGRAM_SUB_COUNT) + HISTOGRAM_SUB_COUNT;
+    return ((sub + 1) << shift) - 1;
+}
+
+static void histogram_record(Histogram* histogram, uint64_t value) {
+    histogram->counts[histogram_index(value)] += 1;
+    histogram->total += 1;
+    if (value > histogram->max)
+        histogram->max = value;
+}
+
+static void histogram_merge(Histogram* into, const Histogram* from) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+        into->counts[i] += from->counts[i];
+    into->total += from->total;
+    if (from->max > into->max)
+        into->max = from->max;
+}
+
+static uint64_t histogram_percentile(const Histogram* histogram, double percentile) {
+    uint64_t target = (uint64_t)(percentile / 100.0 * (double)histogram->total + 0.5);
+    if (target == 0)
+        target = 1;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += histogram->counts[i];
+        if (seen >= target) {
+            uint64_t value = histogram_value(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+
+static TcpClient connect_client(void) {
+    return tcp_connect(g_options.address, g_options.port, CONNECT_TIMEOUT_MS);
+}
+
+
+// NOTE: Sends the payload and reads exactly one response. Returns 0, or -1 if
+//       the connection failed, timed out or was closed.
+static int request(TcpClient* client) {
+    size_t sent = 0;
+    while (sent < g_options.payload_size) {
+        ssize_t bytes = tcp_write_timeout(client, g_payload + sent, g_options.payload_size - sent, REQUEST_TIMEOUT_MS);
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            continue;
+        if (bytes <= 0)
+            return -1;
+        sent += (size_t) bytes;
+    }
+
+    char buffer[16 * 1024];
+    size_t received = 0;
+    while (received < g_options.response_size) {
+        size_t left = g_options.response_size - received;
+        ssize_t bytes = tcp_read_timeout(client, buffer, left < sizeof(buffer) ? left : sizeof(buffer), REQUEST_TIMEOUT_MS);
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            continue;
+        if (bytes <= 0)
+            return -1;
+        received += (size_t) bytes;
+    }
+    return 0;
+}
+
+
+// NOTE: Timers have millisecond resolution, so the rest is spent yielding.
+static void wait_until(uint64_t deadline) {
+    uint64_t now = now_ns();
+    if (deadline > now + 1000000)
+        coroutine_sleep_ms((int)((deadline - now) / 1000000));
+    while (now_ns() < deadline)
+        coroutine_yield();
+}
+
+
+static void connection(void* arg) {
+    Connection* connection = arg;
+    Worker* worker = connection->worker;
+
+    TcpClient client = connect_client();
+    if (tcp_client_status(client) != TCP_CLIENT_CONNECTED) {
+        fprintf(stderr, "connection %d: %s\n", connection->index, tcp_client_error(client));
+        worker->errors += 1;
+        return;
+    }
+
+    // NOTE: In the open loop, the first requests are spread over one interval
+    //       so the connections don't send in lockstep.
+    uint64_t interval = 0;
+    uint64_t next = g_start;
+    if (g_options.rate > 0) {
+        interval = (uint64_t)(1e9 * g_options.connections / g_options.rate);
+        next += interval * (uint64_t)connection->index / (uint64_t)g_options.connections;
+    }
+
+    for (;;) {
+        uint64_t intended = now_ns();
+        if (interval > 0) {
+            if (next >= g_end)
+                break;
+            wait_until(next);
+            intended = next;
+            next += interval;
+        }
+        if (intended >= g_end || now_ns() >= g_end)
+            break;
+
+        if (request(&client) < 0) {
+            worker->errors += 1;
+            close(client.fd);
+            client = connect_client();
+            if (tcp_client_status(client) != TCP_CLIENT_CONNECTED) {
+                fprintf(stderr, "connection %d: %s\n", connection->index, tcp_client_error(client));
+                return;
+            }
+            continue;
+        }
+
+        histogram_record(&worker->latency, now_ns() - intended);
+        worker->requests += 1;
+    }
+
+    close(client.fd);
+}
+
+
+static void* worker_function(void* arg) {
+    Worker* worker = arg;
+
+    int* ids = calloc(worker->count, sizeof(*ids));
+    if (ids == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < worker->count; ++i) {
+        Connection context = { worker, worker->first + i };
+        ids[i] = coroutine_create(connection, &context, sizeof(context), NULL);
+        if (ids[i] < 0)
+            worker->errors += 1;
+    }
+    for (int i = 0; i < worker->count; ++i) {
+        if (ids[i] >= 0)
+            coroutine_join(ids[i]);
+    }
+
+    free(ids);
+    coroutine_destroy_all();
+    return NULL;
+}
+
+
+// NOTE: Learns the response size from one request, by reading until the
+//       server has been quiet for a while.
+static size_t calibrate(void) {
+    TcpClient client = connect_client();
+    if (tcp_client_status(client) != TCP_CLIENT_CONNECTED) {
+        fprintf(stderr, "%s:%d: %s\n", g_options.address, g_options.port, tcp_client_error(client));
+        exit(EXIT_FAILURE);
+    }
+
+    if (tcp_write(&client, g_payload, g_options.payload_size) != (ssize_t) g_options.payload_size) {
+        perror("calibrate");
+        exit(EXIT_FAILURE);
+    }
+
+    char buffer[16 * 1024];
+    size_t received = 0;
+    int timeout = REQUEST_TIMEOUT_MS;
+    for (;;) {
+        ssize_t bytes = tcp_read_timeout(&client, buffer, sizeof(buffer), timeout);
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            continue;
+        if (bytes <= 0)
+            break;
+        received += (size_t) bytes;
+        timeout = CALIBRATE_QUIET_MS;
+    }
+    close(client.fd);
+
+    if (received == 0) {
+        fprintf(stderr, "%s:%d: no response to calibrate with\n", g_options.address, g_options.port);
+        exit(EXIT_FAILURE);
+    }
+    return received;
+}
+
+
+static void request_shutdown(void) {
+    TcpClient client = connect_client();
+    if (tcp_client_status(client) != TCP_CLIENT_CONNECTED) {
+        fprintf(stderr, "shutdown: %s\n", tcp_client_error(client));
+        return;
+    }
+    tcp_write(&client, "shutdown", sizeof("shutdown") - 1);
+    close(client.fd);
+}
+
+
+static void usage(const char* name) {
+    fprintf(stderr,
+        "usage: %s [-a address] [-p port] [-c connections] [-t threads] [-d seconds]\n"
+        "          [-r requests/s] [-s payload bytes] [-R response bytes] [-k]\n"
+        "\n"
+        "  -r  0 (the default) runs a closed loop, anything else an open loop at that rate\n"
+        "  -R  response size, learnt from a first request if not given\n"
+        "  -k  send \"shutdown\" to the server when done\n", name);
+    exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char** argv) {
+    int option;
+    while ((option = getopt(argc, argv, "a:p:c:t:d:r:s:R:k")) != -1) {
+        switch (option) {
+            case 'a': g_options.address       = optarg; break;
+            case 'p': g_options.port          = (uint16_t) atoi(optarg); break;
+            case 'c': g_options.connections   = atoi(optarg); break;
+            case 't': g_options.threads       = atoi(optarg); break;
+            case 'd': g_options.seconds       = atof(optarg); break;
+            case 'r': g_options.rate          = atof(optarg); break;
+            case 's': g_options.payload_size  = (size_t) atol(optarg); break;
+            case 'R': g_options.response_size = (size_t) atol(optarg); break;
+            case 'k': g_options.shutdown      = 1; break;
+            default:  usage(argv[0]);
+        }
+    }
+    if (optind != argc || g_options.connections < 1 || g_options.threads < 1 || g_options.seconds <= 0 ||
+        g_options.rate < 0 || g_options.payload_size < 1)
+        usage(argv[0]);
+    if (g_options.threads > g_options.connections)
+        g_options.threads = g_options.connections;
+
+    // NOTE: Each connection is a descriptor.
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    // NOTE: Anything but a command the example server reacts to.
+    g_payload = malloc(g_options.payload_size);
+    if (g_payload == NULL) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    memset(g_payload, 'x', g_options.payload_size);
+
+    if (g_options.response_size == 0)
+        g_options.response_size = calibrate();
+
+    Worker* workers = calloc(g_options.threads, sizeof(*workers));
+    if (workers == NULL) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    g_start = now_ns();
+    g_end   = g_start + (uint64_t)(g_options.seconds * 1e9);
+    for (int i = 0, first = 0; i < g_options.threads; ++i) {
+        workers[i].first = first;
+        workers[i].count = g_options.connections / g_options.threads + (i < g_options.connections % g_options.threads);
+        first += workers[i].count;
+        if (pthread_create(&workers[i].thread, NULL, worker_function, &workers[i]) != 0) {
+            perror("pthread_create");
+            return EXIT_FAILURE;
+        }
+    }
+
+    Histogram* latency = calloc(1, sizeof(*latency));
+    uint64_t requests = 0;
+    uint64_t errors   = 0;
+    for (int i = 0; i < g_options.threads; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        histogram_merge(latency, &workers[i].latency);
+        requests += workers[i].requests;
+        errors   += workers[i].errors;
+    }
+    double elapsed = (double)(now_ns() - g_start) / 1e9;
+
+    if (g_options.shutdown)
+        request_shutdown();
+
+    printf("mode=%s connections=%d threads=%d rate=%.0f payload=%zu response=%zu seconds=%.2f "
+           "requests=%llu errors=%llu throughput_rps=%.0f p50_us=%.1f p99_us=%.1f p999_us=%.1f max_us=%.1f\n",
+           g_options.rate > 0 ? "open" : "closed", g_options.connections, g_options.threads, g_options.rate,
+           g_options.payload_size, g_options.response_size, elapsed,
+           (unsigned long long) requests, (unsigned long long) errors, (double) requests / elapsed,
+           histogram_percentile(latency, 50)   / 1e3,
+           histogram_percentile(latency, 99)   / 1e3,
+           histogram_percentile(latency, 99.9) / 1e3,
+           latency->max / 1e3);
+
+    free(latency);
+    free(workers);
+    free(g_payload);
+    coroutine_destroy_all();
+    return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,180 @@
+// Converts a dump from `coroutine_trace_dump` to the Chrome trace event
+// format, which chrome://tracing and https://ui.perfetto.dev can open:
+//
+//     build/trace2chrome trace.bin > trace.json
+//
+// Each scheduler thread gets a track with a slice for every stretch a
+// coroutine ran, and waits show up as async slices from the switch until the
+// coroutine was ready again.
+#include "../coroutine.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// NOTE: The low bits of an id are its slot (see COROUTINE__SLOT_BITS).
+#define SLOT(id) ((id) & ((1 << 20) - 1))
+
+static const char* g_names[] = {
+    [CT_SWITCH_IN]  = "switch in",
+    [CT_SWITCH_OUT] = "switch out",
+    [CT_WAIT]       = "wait",
+    [CT_READY]      = "ready",
+    [CT_CREATE]     = "create",
+    [CT_EXIT]       = "exit",
+    [CT_ACCEPT]     = "accept",
+    [CT_DISPATCH]   = "dispatch",
+};
+
+// NOTE: Per slot of the thread being converted, one more than the id
+//       waiting in it, or 0.
+static int*   g_waiting;
+static size_t g_waiting_capacity;
+
+static unsigned long long g_ns_per_tick;
+static unsigned long long g_origin;
+static int                g_first = 1;
+
+
+static double micros(unsigned long long stamp) {
+    unsigned long long ticks = (stamp >> 8) - g_origin;
+    return (double)(((unsigned __int128)ticks * g_ns_per_tick) >> 32) / 1000.0;
+}
+
+
+static void emit(const char* format, ...) __attribute__((format(printf, 1, 2)));
+static void emit(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    printf("%s\n    ", g_first ? "" : ",");
+    vprintf(format, args);
+    va_end(args);
+    g_first = 0;
+}
+
+
+static void convert(unsigned thread, const CoroutineTraceEvent* events, unsigned count) {
+    emit("{\"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"name\": \"thread_name\", \"args\": {\"name\": \"scheduler %u\"}}", thread, thread);
+
+    // NOTE: A dump starts wherever the ring wrapped, so the first slice might
+    //       have no start and the first waits no begin. Those are skipped.
+    int    running = -1;
+    double since   = 0;
+    memset(g_waiting, 0, g_waiting_capacity * sizeof(*g_waiting));
+    for (unsigned i = 0; i < count; ++i) {
+        const CoroutineTraceEvent* event = &events[i];
+        int    type = (int)(event->stamp & 0xFF);
+        double ts   = micros(event->stamp);
+        size_t slot = (size_t)SLOT(event->id);
+
+        if ((type == CT_WAIT || type == CT_READY) && slot >= g_waiting_capacity) {
+            size_t capacity = g_waiting_capacity ? g_waiting_capacity : 1024;
+            while (capacity <= slot)
+                capacity *= 2;
+            g_waiting = realloc(g_waiting, capacity * sizeof(*g_waiting));
+            if (g_waiting == NULL) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+            memset(g_waiting + g_waiting_capacity, 0, (capacity - g_waiting_capacity) * sizeof(*g_waiting));
+            g_waiting_capacity = capacity;
+        }
+
+        switch (type) {
+            case CT_SWITCH_IN: {
+                running = event->id;
+                since   = ts;
+            } break;
+            case CT_SWITCH_OUT:
+            case CT_WAIT:
+            case CT_EXIT: {
+                if (running == event->id) {
+                    emit("{\"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"name\": \"coroutine %d\", \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"id\": %d}}",
+                         thread, SLOT(event->id), since, ts - since, event->id);
+                    running = -1;
+                }
+                if (type == CT_WAIT) {
+                    g_waiting[slot] = event->id + 1;
+                    emit("{\"ph\": \"b\", \"pid\": 1, \"tid\": %u, \"cat\": \"wait\", \"name\": \"wait\", \"id\": \"%u:%d\", \"ts\": %.3f, \"args\": {\"fd\": %d}}",
+                         thread, thread, event->id, ts, event->fd);
+                } else if (type == CT_EXIT) {
+                    emit("{\"ph\": \"i\", \"s\": \"t\", \"pid\": 1, \"tid\": %u, \"name\": \"exit\", \"ts\": %.3f, \"args\": {\"id\": %d}}",
+                         thread, ts, event->id);
+                }
+            } break;
+            case CT_READY: {
+                if (g_waiting[slot] != event->id + 1)
+                    break;
+                g_waiting[slot] = 0;
+                emit("{\"ph\": \"e\", \"pid\": 1, \"tid\": %u, \"cat\": \"wait\", \"name\": \"wait\", \"id\": \"%u:%d\", \"ts\": %.3f}",
+                     thread, thread, event->id, ts);
+            } break;
+            default: {
+                const char* name = (type < CT_USER) ? g_names[type] : "user";
+                emit("{\"ph\": \"i\", \"s\": \"t\", \"pid\": 1, \"tid\": %u, \"name\": \"%s\", \"ts\": %.3f, \"args\": {\"id\": %d, \"fd\": %d, \"type\": %d}}",
+                     thread, name, ts, event->id, event->fd, type);
+            } break;
+        }
+    }
+}
+
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <trace.bin>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE* file = fopen(argv[1], "rb");
+    if (file == NULL) {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    CoroutineTraceHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, COROUTINE_TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != COROUTINE_TRACE_VERSION) {
+        fprintf(stderr, "%s: not a coroutine trace (version %d)\n", argv[1], COROUTINE_TRACE_VERSION);
+        return EXIT_FAILURE;
+    }
+    g_ns_per_tick = header.ns_per_tick;
+
+    // NOTE: Read everything first, so all threads share the earliest stamp as
+    //       their origin.
+    CoroutineTraceThread* threads = calloc(header.threads, sizeof(*threads));
+    CoroutineTraceEvent** events  = calloc(header.threads, sizeof(*events));
+    if (header.threads > 0 && (threads == NULL || events == NULL)) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    g_origin = ~0ull;
+    for (unsigned i = 0; i < header.threads; ++i) {
+        if (fread(&threads[i], sizeof(threads[i]), 1, file) != 1) {
+            fprintf(stderr, "%s: truncated\n", argv[1]);
+            return EXIT_FAILURE;
+        }
+        events[i] = malloc((threads[i].count + 1) * sizeof(**events));
+        if (events[i] == NULL || fread(events[i], sizeof(**events), threads[i].count, file) != threads[i].count) {
+            fprintf(stderr, "%s: truncated\n", argv[1]);
+            return EXIT_FAILURE;
+        }
+        if (threads[i].count > 0 && (events[i][0].stamp >> 8) < g_origin)
+            g_origin = events[i][0].stamp >> 8;
+    }
+    fclose(file);
+
+    printf("{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+    for (unsigned i = 0; i < header.threads; ++i) {
+        convert(threads[i].thread, events[i], threads[i].count);
+        free(events[i]);
+    }
+    printf("\n]}\n");
+
+    free(events);
+    free(threads);
+    return EXIT_SUCCESS;
+}